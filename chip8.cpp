@@ -1,19 +1,130 @@
-﻿#include <stdbool.h>
+﻿#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef NO_SDL
+// Core only build (make bench): headless, batch and benchmark runs without a window, audio or input.
+// The few SDL utilities the core uses map to the standard library
+#define SDL_Log(...) fprintf(stderr, __VA_ARGS__)
+uint64_t SDL_GetPerformanceCounter(void) { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+uint64_t SDL_GetPerformanceFrequency(void) { return std::chrono::steady_clock::period::den / std::chrono::steady_clock::period::num; }
+void SDL_Delay(const uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+uint32_t SDL_GetTicks(void) {
+  static const auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+#else
 #include "SDL.h"
+#endif
+
+// Count heap allocations so the benchmark can report them. Only in the Linux core build (make bench), where the
+// program's malloc replaces glibc's for the whole process: operator new, std::thread and stdio allocate through it too
+#if defined(NO_SDL) && !defined(FUZZ) && !defined(AUDIO_CHECK) && defined(__GLIBC__)
+#define COUNT_ALLOCATIONS
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+std::atomic<uint64_t> allocations;
+extern "C" void *malloc(size_t size) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t count, size_t size) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+extern "C" void *realloc(void *ptr, size_t size) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+// Sound: once per 60hz tick the emulation posts the tone state if it changed, stamped with the output sample it
+// takes effect at. The audio callback consumes the events and resamples one period of the tone (the square wave, or
+// the XO-CHIP pattern) to the output rate. No locks and no SDL calls on the emulation side.
+// A device plays on from init, through pauses and rewinds, so emulated audio time is moved up to playback whenever
+// it falls behind, and events are stamped one device buffer later than that: the callback that reaches them hasn't
+// run yet and switches the tone on the exact sample.
+#define SOUND_RING_SIZE 64  // power of 2, events are only posted when the tone changes
+#define AUDIO_BLOCK 512     // samples per audio callback
+#define WAVE_LEN 128        // one period, = the 128 bit XO-CHIP pattern
+typedef struct {
+  uint64_t sample;  // emulated time in output samples
+  bool on;          // sound timer running
+  bool pattern_loaded;
+  uint8_t pitch;
+  uint8_t pattern[16];
+} sound_event_t;
+
+typedef struct {
+  sound_event_t events[SOUND_RING_SIZE];
+  std::atomic<uint32_t> head;  // next write, only the emulation thread stores it
+  std::atomic<uint32_t> tail;  // next read, only the audio callback stores it
+  uint32_t sample_rate;
+  uint32_t square_wave_freq;
+  int16_t volume;
+
+  // Emulation side
+  uint64_t emu_sample;   // output samples emulated so far
+  uint32_t latency;      // samples from emulated time to an event's stamp: a device buffer, 0 for WAV output
+  uint32_t emu_carry;    // sample_rate / 60 remainder carried to the next tick
+  sound_event_t posted;  // last tone state posted
+
+  // Audio callback side
+  uint64_t play_sample;    // output samples played so far
+  std::atomic<uint64_t> played;  // play_sample at the end of the last callback, for the emulation side
+  int16_t wave[WAVE_LEN];  // one period of the current tone at volume
+  uint64_t step;           // 32.32 fixed point wave positions per output sample
+  uint64_t phase;          // 32.32 fixed point position in wave
+  bool on;
+} audio_t;
 
 // SDL Container
 typedef struct {
+#ifndef NO_SDL
   SDL_Window *window;
   SDL_Renderer *renderer;
+  SDL_Texture *screen;       // Streaming 128x64 texture, the current resolution is scaled up by SDL_RenderCopy
+  SDL_Texture *outlines[2];  // Pixel outline grid overlay at window resolution, [hires]
   SDL_AudioSpec want, have;
   SDL_AudioDeviceID dev;
+  const struct keymap *keymap;  // host key -> emulator input
+#endif
+  audio_t *audio;  // NULL = no sound (headless)
 } sdl_t;
 
+// CPU core variants
+typedef enum {
+  INTERPRETER,  // fetch + decode on every instruction
+  PREDECODE,    // decode once per address, cached in chip8_t::decode_cache
+  THREADED,     // predecoded basic blocks run back to back without per-instruction fetch/lookup
+} emu_engine_t;
+
 // EMU CONFIG
 typedef struct {
   uint32_t window_width;      // SDL window width
@@ -26,6 +137,36 @@ typedef struct {
   uint32_t square_wave_freq;  // Фрекфенција од меандер на звук, пример 440hz
   uint32_t audio_sample_rate;
   uint16_t volume;  // Звук
+  bool headless;              // Без SDL прозорец/звук, работи со полна брзина на host-от
+  uint64_t max_instructions;  // Headless: стоп по N инструкции (0 = без лимит)
+  uint64_t max_frames;        // Headless: стоп по N 60hz фрејмови (0 = без лимит)
+  emu_engine_t engine;        // CPU core variant
+  bool unthrottled;           // Не чекај 60hz, емулирај колку што може побрзо
+  bool vsync;                 // Present on the display's vertical blank
+  uint32_t frame_skip;        // Most frames in a row left unrendered while catching up on a late schedule (0 = render every change)
+  bool emu_thread;            // Емулација на посебна нишка, SDL нишката само црта и чита влез
+  uint32_t seed;              // CXNN random seed
+  char **roms;                // ROM files from the command line
+  uint32_t rom_count;
+  bool batch;                 // Headless run of every ROM x instances in parallel
+  uint32_t instances;         // Batch: instances per ROM, each with its own seed
+  uint32_t threads;           // Batch: worker threads (0 = one per core)
+  bool lanes;                 // Batch: step LANES machines at a time in lockstep, ALU opcodes across all of them at once
+  char *load_state_file;      // Restore this save state after loading the ROM
+  char *save_state_file;      // Write a save state here on exit
+  uint32_t rewind_seconds;    // Rewind history length (0 = off)
+  char *trace_file;           // Trace from the start into this file, F10 toggles (default chip8.trace)
+  char *decode_trace_file;    // Print this trace as text and exit
+  bool profile;               // Count opcodes/addresses and time each part of a frame, report on exit
+  bool bench;                 // Run the built in benchmark ROMs on every engine, JSON per run
+  char *wav_file;             // Headless: render the sound to this WAV file
+  char *keymap_file;          // Key bindings over the defaults, "<SDL key name> = <0-F|action>" per line
+  char *record_file;          // Record the keypad into this movie from launch to exit
+  char *replay_file;          // Replay this movie headless at full speed
+  char *library_dir;          // ROMs can be named by file name or content hash from this directory
+  char *rom_db_file;          // Per ROM quirks, clock speed, colors and keymap keyed by content hash
+  char *shm_name;             // Publish every frame into this shared memory segment, read the keypad from it
+  bool ips_set;               // --ips given, wins over the ROM database
 } config_t;
 
 // EMU STATES
@@ -44,11 +185,144 @@ typedef struct {
   uint8_t Y;     // 4 bit идентификатор за регистер
 } instruction_t;
 
-// CHIP8 Machine Object
+#define ENTRY_POINT 0x200   // Chip8 Roms will be loaded to 0x200 aka memory location 512
+#define BIG_FONT 0x50       // SCHIP 8x10 font, after the 4x5 font at 0x000
+#define MAX_BLOCK_LEN 32    // Max instructions in one translated basic block
+
+typedef struct chip8 chip8_t;
+typedef void (*opcode_handler_t)(chip8_t *chip8, const config_t *config);
+
+// Predecoded instruction; handler == NULL means the slot is empty
+typedef struct {
+  opcode_handler_t handler;
+  instruction_t inst;
+} decoded_inst_t;
+
+// Binary trace: one fixed size record per executed instruction, written on the emulation thread into a
+// preallocated lock-free ring and drained to a file by a background thread. In the file a record is its
+// first TRACE_RECORD_HEADER bytes followed by only the registers in changed, in register order. Host byte order.
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE (1u << 20)  // power of 2, 24 MB
+#define TRACE_FRAME 0xFFFF          // pc of a 60hz tick marker, no instruction lives there
+#define TRACE_RECORD_HEADER 8       // pc, opcode, I, changed
+typedef struct {
+  uint16_t pc;       // address of the instruction
+  uint16_t opcode;   // frame marker: low 16 bits of the frame number
+  uint16_t I;        // I after the instruction
+  uint16_t changed;  // bit x = V[x] was changed by the instruction (FX65 and the shift quirk can change several)
+  uint8_t V[16];     // registers after the instruction
+} trace_record_t;
+
+typedef struct {
+  trace_record_t *records;     // TRACE_RING_SIZE, allocated when a trace starts
+  std::atomic<uint32_t> head;  // next write, only the emulation thread stores it
+  std::atomic<uint32_t> tail;  // next read, only the writer thread stores it
+  uint64_t dropped;            // records lost to a full ring, emulation thread only
+  std::atomic<bool> stop;
+  std::thread writer;
+  FILE *file;
+  const char *path;
+} tracer_t;
+
+// Profiler: executions per opcode and per address, and time spent in each part of a frame.
+// Opcodes are grouped into handler classes (DXYN, 8XY4, ...) only when reported.
+typedef enum {
+  PROFILE_EMULATE,
+  PROFILE_SCREEN,
+  PROFILE_INPUT,
+  PROFILE_TIMERS,
+  PROFILE_SLEEP,
+  PROFILE_SECTIONS,
+} profile_section_t;
+
+typedef struct {
+  uint64_t opcodes[65536];                   // executions per opcode value
+  uint64_t pcs[4096];                        // executions per address
+  uint64_t ticks[PROFILE_SECTIONS];          // performance counter ticks per section
+  uint64_t calls[PROFILE_SECTIONS];
+  uint64_t last_ticks[PROFILE_SECTIONS];     // live overlay: totals at the previous update
+  uint64_t last_cycles;
+  uint64_t last_time;
+} profile_t;
+
+// Framebuffer: up to 4 XO-CHIP bit planes of 128x64 (SCHIP hi-res). Low res (64x32) uses rows 0-31 and word 0 only.
+// A pixel's color index has bit p set when it is on in plane p
+#define DISPLAY_PLANES 4
+#define DISPLAY_ROWS 64
+#define ROW_WORDS 2  // 128 pixels a row, bit 63 of word 0 = left pixel
+typedef struct {
+  uint64_t planes[DISPLAY_PLANES][DISPLAY_ROWS][ROW_WORDS];
+  bool hires;  // 128x64 (00FF) instead of 64x32 (00FE)
+} display_t;
+
+static inline uint8_t display_width(const display_t *display) { return display->hires ? 128 : 64; }
+static inline uint8_t display_rows(const display_t *display) { return display->hires ? 64 : 32; }
+
+// Behaviour that differs between CHIP-8 interpreters, set per ROM. The defaults are what this emulator always did
+typedef struct {
+  bool shift;       // 8XY6/8XYE shift VX in place (SCHIP), otherwise VX = VY shifted (COSMAC)
+  bool load_store;  // FX55/FX65 leave I alone (SCHIP), otherwise I += X + 1 (COSMAC)
+  bool jump;        // BNNN jumps to XNN + VX (SCHIP), otherwise NNN + V0
+  bool clip;        // sprites are cut at the screen edges, otherwise they wrap around
+} quirks_t;
+
+const quirks_t default_quirks = {.shift = true, .load_store = true, .jump = false, .clip = true};
+
+// The same quirks as compile time flags: the handlers that depend on them are templates and every
+// combination gets its own decoder, picked once when the ROM is loaded, so no quirk is tested per instruction
+#define QUIRK_SHIFT 0x1
+#define QUIRK_LOAD_STORE 0x2
+#define QUIRK_JUMP 0x4
+#define QUIRK_CLIP 0x8
+#define QUIRK_PROFILES 16
+#define DEFAULT_QUIRK_PROFILE (QUIRK_SHIFT | QUIRK_LOAD_STORE | QUIRK_CLIP)
+
+typedef decoded_inst_t (*decoder_t)(const uint16_t opcode);
+decoder_t quirk_decoder(const quirks_t quirks);  // with the opcode handlers below
+
+// Per ROM settings from the --rom-db file, keyed by content hash
+typedef struct {
+  uint64_t hash;
+  quirks_t quirks;
+  uint32_t inst_per_second;  // 0 = not set
+  uint32_t fg_color;
+  uint32_t bg_color;
+  bool colors_set[2];        // fg, bg
+  char *keymap_file;         // NULL = not set
+} rom_settings_t;
+
+// ROM image mapped read only for the whole run: resets and batch instances copy from it, no file I/O
+typedef struct {
+  char *path;
+  const uint8_t *data;              // NULL for an empty file
+  size_t size;
+  uint64_t hash;                    // FNV-1a of the contents, computed on first use (hashed)
+  bool hashed;
+  const rom_settings_t *settings;   // NULL = defaults
+} rom_t;
+
+// Spin detection: everything an instruction can read, apart from RAM and display (counted in writes) and
+// the timers and keypad (constant within a slice). Finding it unchanged at the same backward jump means the loop
+// will keep going round until a timer tick or key changes something
+#define NO_IDLE 0xFFFFFFFF
+
 typedef struct {
+  uint8_t V[16];
+  uint16_t I;
+  uint16_t stack[12];
+  uint8_t sp;
+  uint8_t delay_timer;
+  uint32_t rng;
+  uint32_t writes;
+} idle_state_t;
+
+// CHIP8 Machine Object
+typedef struct chip8 {
   uint8_t ram[4096];
   emulator_state_t state;
-  bool display[64 * 32];  // емулирај пиксели на оригинална Chip8 резолуција
+  display_t display;     // емулирај пиксели, еден ред по два збора, bit 63 = лев пиксел
+  uint8_t plane_mask;    // XO-CHIP planes drawn, cleared and scrolled (FN01), 1 = plane 0 only
+  uint64_t dirty;        // Rows changed since the renderer last took the display, bit y = row y
   uint16_t stack[12];  // Subroutine stack // субрутина е сет од инструкции наменети да извршуваат често користени операции во програма
   uint16_t *stack_ptr;  // stack pointer
   uint8_t V[16];        // Data registers V0-VF
@@ -58,26 +332,356 @@ typedef struct {
   uint8_t sound_timer;  // Decrements at 60hz and plays tone when >0
   bool keypad[16];      // Hexadecimal keypad 0x0-0xF
   char *rom_name;       // Currently running ROM
+  const rom_t *rom;     // Its mapped image, reset reloads from it (NULL for the built in benchmark ROMs)
+  decoder_t decode;     // Decoder for this ROM's quirk profile
   instruction_t inst;   // Currently executing instruction
-  bool draw;            // Update screen yes/no
+  bool draw;            // Screen changed since the last present (00E0, DXYN, scrolls, mode switch, reset, load), frames without skip rendering
+  uint64_t cycles;      // Executed instructions since reset
+  uint64_t frames;      // 60hz timer ticks since reset
+  decoded_inst_t decode_cache[4096 - ENTRY_POINT];  // Predecoded program region 0x200-0xFFF, indexed by PC - 0x200
+  uint8_t block_len[4096 - ENTRY_POINT];            // Translated basic block length starting at PC - 0x200, 0 = not translated
+  uint32_t seed;        // CXNN seed, reapplied on reset
+  uint32_t rng;         // xorshift32 state, per machine so instances can run on any thread
+  uint8_t audio_pattern[16];  // XO-CHIP 1-bit audio pattern, 128 samples played MSB first (F002)
+  bool pattern_loaded;        // play audio_pattern instead of the square wave
+  uint8_t pitch;              // XO-CHIP pattern playback rate 4000 * 2^((pitch - 64) / 48) hz (FX3A)
+  uint32_t writes;            // Display and RAM changes, a loop that makes any isn't idle
+  uint32_t idle_pc;           // Backward jump last seen in this slice (NO_IDLE = none) ...
+  idle_state_t idle_state;    // ... the machine as it was then ...
+  uint64_t idle_cycles;       // ... and when
+  uint32_t idle_period;       // Instructions per round of a detected spin, 0 = not spinning
+  tracer_t *trace;      // Active trace (NULL = tracing off), kept across reset
+  profile_t *profile;   // --profile counters (NULL = off), kept across reset
 } chip8_t;
 
+// Save state: versioned little endian image of the machine. No pointers (rom_name, stack_ptr is stored as an index)
+// and no decode caches, those are rebuilt after a restore.
+#define SAVE_STATE_VERSION 1
+#define DISPLAY_WORDS (DISPLAY_PLANES * DISPLAY_ROWS * ROW_WORDS)
+#define SAVE_STATE_SIZE                                                                                                        \
+  (4 + 2 + /* magic, version */ 2 + 2 + 16 + /* PC, I, V */ 1 + 12 * 2 + /* stack */ 1 + 1 + 2 + /* timers, keypad bits */ \
+   4 + 4 + 8 + 8 + /* seed, rng, cycles, frames */ 1 + 1 + 16 + /* pitch, pattern loaded, pattern */                        \
+   1 + 1 + DISPLAY_WORDS * 8 + /* hires, plane mask, display */ 4096 /* ram */)
+
+// Rewind: one save state per frame, grouped as a full keyframe followed by deltas against it.
+// A delta is the XOR with the keyframe, run length encoded as [u16 zero bytes][u16 literal bytes][literals]...,
+// most of RAM and the display don't change so a frame costs tens of bytes instead of 4 KB.
+#define REWIND_GROUP_FRAMES 60  // a keyframe every second
+typedef struct {
+  uint8_t *data;  // keyframe (SAVE_STATE_SIZE bytes) then the deltas
+  uint32_t size;
+  uint32_t capacity;
+  uint32_t offsets[REWIND_GROUP_FRAMES];  // start of each frame in data, [0] is the keyframe
+  uint8_t frames;                          // frames recorded in this group
+} rewind_group_t;
+
+// Movie: the machine state at the start, then every keypad transition and reset keyed by frame and by
+// instruction within that frame. Recorded from a window, replayed headless at full speed to the same machine.
+// The engine and quirks it was recorded with are replayed too, whatever the ROM database says now.
+// "C8MV" | u16 version | u32 ips | u8 engine | u8 quirks (QUIRK_* bits) | u32 frames | u32 state size | start save state |
+// records, all little endian
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE (4 + 2 + 4 + 1 + 1 + 4 + 4)
+#define MOVIE_FRAMES_OFFSET (4 + 2 + 4 + 1 + 1)
+#define MOVIE_RECORD_SIZE (4 + 4 + 1 + 1)  // frame, instruction, type, key
+typedef enum {
+  MOVIE_KEY_UP,
+  MOVIE_KEY_DOWN,
+  MOVIE_RESET,
+} movie_event_type_t;
+
+typedef struct {
+  uint32_t frame;
+  uint32_t inst;  // instructions run in the frame before this event
+  uint8_t type;   // movie_event_type_t
+  uint8_t key;
+} movie_event_t;
+
+typedef struct {
+  FILE *file;              // recording
+  movie_event_t *events;   // replay
+  uint32_t event_count;
+  uint32_t next_event;     // replay position
+  uint32_t ips;            // instructions per second of the recording, replay uses the same
+  emu_engine_t engine;     // core of the recording, replay uses the same
+  quirks_t quirks;         // quirks of the recording, replay decodes with the same
+  uint32_t frames;         // frames recorded, or the length of the replayed movie
+  uint32_t frame;          // current frame
+  uint64_t frame_cycles;   // chip8->cycles when the current frame started (shifted across resets)
+} movie_t;
+
+// Shared memory export: the display, keypad and frame counter of every frame for other processes on the host,
+// and a keypad the consumer can hold keys on. One writer (the emulation thread), any number of readers.
+// Seqlock: seq is odd while a frame is written. A reader copies what it needs between two loads of seq
+// (acquire) and keeps the copy only if both are the same even number, otherwise it tries again.
+// Everything but keys is written by the emulator only, keys only by the consumer (bit k = hold key k).
+// A pause is published once, and again whenever a reset or state load redraws the paused machine.
+// examples/shm_reader.c is a reader in plain C with the same layout.
+#define SHM_VERSION 1
+typedef struct {
+  char magic[4];               // "C8FB"
+  uint32_t version;
+  uint32_t size;               // sizeof(shm_frame_t), readers check it against their own layout
+  std::atomic<uint32_t> seq;   // frame sequence, odd while writing
+  uint64_t frame;              // 60hz frames run
+  uint64_t cycles;             // instructions run
+  uint16_t keypad;             // machine keypad, bit k = key k down
+  uint8_t state;               // emulator_state_t, QUIT once the emulator is gone
+  display_t display;
+  std::atomic<uint32_t> keys;  // consumer keypad
+} shm_frame_t;
+
+// Readers in other languages hard code these offsets (x86-64 and AArch64, little endian)
+static_assert(offsetof(shm_frame_t, seq) == 12 && offsetof(shm_frame_t, frame) == 16 && offsetof(shm_frame_t, keypad) == 32 &&
+                  offsetof(shm_frame_t, state) == 34 && offsetof(shm_frame_t, display) == 40 &&
+                  offsetof(shm_frame_t, display.hires) == 4136 && offsetof(shm_frame_t, keys) == 4144 && sizeof(shm_frame_t) == 4152,
+              "shm_frame_t layout changed, bump SHM_VERSION and update examples/shm_reader.c");
+
+typedef struct {
+  shm_frame_t *frame;
+  char name[256];
+  uint16_t keys;  // consumer keypad as last applied to the machine
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+} shm_t;
+
+#define SAVE_SLOTS 4
+typedef struct {
+  uint8_t slots[SAVE_SLOTS][SAVE_STATE_SIZE];  // in-memory snapshots, F5 save / F9 load
+  bool used[SAVE_SLOTS];
+  uint8_t slot;  // selected with F1-F4
+
+  rewind_group_t *rewind;  // ring of groups, the oldest is recycled when full (NULL = rewind off)
+  uint32_t rewind_groups;  // ring capacity
+  uint32_t rewind_head;    // newest group
+  uint32_t rewind_count;   // groups in use
+  bool rewinding;          // rewind key held, step back a frame per tick instead of emulating
+
+  tracer_t *tracer;        // F10 starts/stops a trace into tracer->path
+  movie_t *movie;          // --record: keypad transitions go to the movie, rewind and slot loads are off
+  shm_t *shm;              // --shm: frames out, consumer keypad in (NULL = off)
+} session_t;
+
+// User input, applied to the machine directly or passed from the SDL thread to the emulation thread
+typedef enum {
+  INPUT_NONE,  // unbound key
+  INPUT_KEY_DOWN,
+  INPUT_KEY_UP,
+  INPUT_PAUSE,  // toggle pause/resume
+  INPUT_RESET,
+  INPUT_QUIT,
+  INPUT_SELECT_SLOT,  // key = save slot
+  INPUT_SAVE_STATE,
+  INPUT_LOAD_STATE,
+  INPUT_REWIND,  // key = 1 while held, 0 on release
+  INPUT_TRACE,   // toggle tracing
+  INPUT_REDRAW,  // window exposed or resized, present the screen again
+} input_type_t;
+
+typedef struct {
+  input_type_t type;
+  uint8_t key;    // keypad 0x0-0xF for INPUT_KEY_DOWN/UP
+  uint32_t time;  // SDL_GetTicks() when it happened, places the event inside the next tick
+} input_event_t;
+
+#ifndef NO_SDL
+// Host key (scancode, so the keypad stays in the same place on every layout) -> emulator input.
+// Keypad keys and rewind also send the release, everything else acts on press only
+typedef struct keymap {
+  struct {
+    input_type_t type;
+    uint8_t key;
+  } keys[SDL_NUM_SCANCODES];
+} keymap_t;
+#endif
+
+// Single producer (SDL thread) single consumer (emulation thread) lock-free ring. The mutex and condition variable
+// are only for a paused consumer to sleep on until the next event, pushing and popping never take the lock
+#define INPUT_RING_SIZE 64  // power of 2
+#define IDLE_WAIT_MS 100    // longest sleep waiting for input while paused
+typedef struct {
+  input_event_t events[INPUT_RING_SIZE];
+  std::atomic<uint32_t> head;  // next write, only the producer stores it
+  std::atomic<uint32_t> tail;  // next read, only the consumer stores it
+  std::mutex lock;
+  std::condition_variable pushed;
+} input_ring_t;
+
+// Lock-free triple buffer of the display. The emulation thread draws into back and publishes it by swapping it
+// with latest, the SDL thread takes latest by swapping it with front. Neither side ever waits on the other.
+#define FRESH_FRAME 0x80  // set in latest until the SDL thread takes it
+// Rows changed since the SDL thread last looked are OR'd into dirty after each publish.
+typedef struct {
+  display_t display[3];
+  std::atomic<uint64_t> dirty;  // bit y = row y changed
+  std::atomic<uint8_t> latest;  // buffer index | FRESH_FRAME
+  std::atomic<bool> paused;     // nothing new will be published, the SDL thread can sleep until input arrives
+  std::atomic<bool> done;       // the emulation thread stopped on its own (stack fault, end of a replay) or on quit
+  uint8_t back;                 // owned by the emulation thread
+  uint8_t front;                // owned by the SDL thread
+} frame_buffer_t;
+
+// 60hz tick pacing, tick n is due at start_time + n / 60 s
+typedef struct {
+  uint64_t perf_freq;
+  uint64_t start_time;
+  uint64_t tick;
+  uint32_t carry;       // inst_per_second / 60 remainder carried to the next tick
+  uint32_t input_time;  // SDL_GetTicks() at the start of the previous tick, input since then is spread over this one
+  uint32_t skipped;     // Frames in a row not rendered because the schedule was late
+  audio_t *audio;       // sound device to resync with on restarts (NULL = none)
+} scheduler_t;
+
+// Precompute the square wave tone, the sound is off until the first event
+void init_audio(audio_t *audio, const config_t *config) {
+  audio->sample_rate = config->audio_sample_rate;
+  audio->square_wave_freq = config->square_wave_freq;
+  audio->volume = config->volume;
+  audio->posted.pitch = 64;
+}
+
+// Audio callback: switch to the tone in event. The wave is one period, either the square wave (first half trough,
+// "negative volume", second half crest) or the pattern bits MSB first, and step is how far to move through it per sample
+void set_tone(audio_t *audio, const sound_event_t *event) {
+  double freq;  // wave periods per second
+
+  audio->on = event->on;
+  if (event->pattern_loaded) {
+    for (uint32_t i = 0; i < WAVE_LEN; i++) {
+      audio->wave[i] = ((event->pattern[i / 8] >> (7 - i % 8)) & 1) ? audio->volume : -audio->volume;
+    }
+    freq = 4000.0 * pow(2.0, (event->pitch - 64) / 48.0) / WAVE_LEN;  // pattern bits per second / bits per period
+  } else {
+    for (uint32_t i = 0; i < WAVE_LEN; i++) audio->wave[i] = (i < WAVE_LEN / 2) ? -audio->volume : audio->volume;
+    freq = audio->square_wave_freq;
+  }
+  audio->step = (uint64_t)(freq * WAVE_LEN / audio->sample_rate * 4294967296.0);
+}
+
+// Emulation thread: continue emulated audio time from the playback position if it fell behind (device started
+// before the first tick, paused, rewinding, host stall, device clock a little faster than the host's)
+void resync_audio(audio_t *audio) {
+  const uint64_t played = audio->played.load(std::memory_order_acquire);
+  if (audio->emu_sample < played) {
+    audio->emu_sample = played;
+    audio->emu_carry = 0;
+  }
+}
+
+// Emulation thread, once per 60hz tick: post the tone if it changed and advance emulated audio time
+void queue_sound(audio_t *audio, const chip8_t *chip8) {
+  resync_audio(audio);
+  sound_event_t event = {
+      .sample = audio->emu_sample + audio->latency,
+      .on = chip8->sound_timer > 0,  // Tone plays this tick while the sound timer runs
+      .pattern_loaded = chip8->pattern_loaded,
+      .pitch = chip8->pitch,
+      .pattern = {},
+  };
+  memcpy(event.pattern, chip8->audio_pattern, sizeof event.pattern);
+
+  if (event.on != audio->posted.on || event.pattern_loaded != audio->posted.pattern_loaded || event.pitch != audio->posted.pitch ||
+      memcmp(event.pattern, audio->posted.pattern, sizeof event.pattern) != 0) {
+    const uint32_t head = audio->head.load(std::memory_order_relaxed);
+    if (head - audio->tail.load(std::memory_order_acquire) < SOUND_RING_SIZE) {
+      audio->events[head % SOUND_RING_SIZE] = event;
+      audio->head.store(head + 1, std::memory_order_release);
+      audio->posted = event;
+    }  // full: try again next tick
+  }
+
+  audio->emu_carry += audio->sample_rate;
+  audio->emu_sample += audio->emu_carry / 60;
+  audio->emu_carry %= 60;
+}
+
+// Resample count samples of the tone (or silence) to out. No branches per sample, the index is computed from i
+// so the loop has no carried dependency besides the store
+void render_wave(audio_t *audio, int16_t *out, const uint32_t count) {
+  const uint64_t phase = audio->phase;
+  const uint64_t step = audio->step;
+
+  if (audio->on) {
+    const int16_t *wave = audio->wave;
+    for (uint32_t i = 0; i < count; i++) out[i] = wave[((phase + i * step) >> 32) % WAVE_LEN];
+  } else {
+    memset(out, 0, count * sizeof out[0]);
+  }
+  audio->phase = (phase + count * step) & (((uint64_t)WAVE_LEN << 32) - 1);  // keep the phase continuous across on/off
+}
+
+// Fill out stream/audio buffer, switching the tone on/off at the exact sample each queued event asks for
 void audio_callback(void *userdata, uint8_t *stream, int len) {
-  // Fill out stream/audio buffer with data
-  config_t *config = (config_t *)userdata;
+  audio_t *audio = (audio_t *)userdata;
+  int16_t *out = (int16_t *)stream;
+  uint32_t count = len / sizeof out[0];  // We are filling out 2 bytes at a time (int16_t), len is in bytes
+  const uint64_t max_lead = audio->sample_rate / 20;
+
+  while (count) {
+    uint32_t run = count;
+
+    const uint32_t tail = audio->tail.load(std::memory_order_relaxed);
+    if (tail != audio->head.load(std::memory_order_acquire)) {
+      const sound_event_t event = audio->events[tail % SOUND_RING_SIZE];
+
+      // Emulation running more than 50ms ahead of playback (started late, SDL_Delay jitter): catch up instead of
+      // letting latency build. Events from the past take effect right away
+      if (event.sample > audio->play_sample + max_lead) audio->play_sample = event.sample;
 
-  int16_t *audio_data = (int16_t *)stream;
-  static uint32_t running_sample_index = 0;
-  const int32_t square_wave_period = config->audio_sample_rate / config->square_wave_freq;
-  const int32_t half_square_wave_period = square_wave_period / 2;
+      if (event.sample <= audio->play_sample) {
+        set_tone(audio, &event);
+        audio->tail.store(tail + 1, std::memory_order_release);
+        continue;
+      }
+      if (event.sample - audio->play_sample < run) run = event.sample - audio->play_sample;
+    }
+
+    render_wave(audio, out, run);
+    out += run;
+    count -= run;
+    audio->play_sample += run;
+  }
+  audio->played.store(audio->play_sample, std::memory_order_release);
+}
+
+#ifndef NO_SDL
+// Pixel outline overlay: 1px BG COLOR border around every scaled pixel, transparent inside.
+// Same look as drawing an outline around each lit pixel, unlit pixels are BG COLOR anyway.
+// Hi-res pixels are half as big; below 2x2 there is no room for a border and the overlay is skipped.
+bool init_outline(sdl_t *sdl, const config_t *config, const bool hires) {
+  const uint32_t width = config->window_width * config->scale_factor;
+  const uint32_t height = config->window_height * config->scale_factor;
+  const uint32_t border = config->bg_color | 0xFF;  // opaque, the old SDL_RenderDrawRect ignored alpha
+  const uint32_t cell = hires ? config->scale_factor / 2 : config->scale_factor;
+  const uint32_t last = cell - 1;
+
+  if (cell < 2) return true;
+  SDL_Texture *outlines = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, width, height);
+  if (!outlines) {
+    SDL_Log("Could not create outline texture %s\n", SDL_GetError());
+    return false;
+  }
+  SDL_SetTextureBlendMode(outlines, SDL_BLENDMODE_BLEND);
+  sdl->outlines[hires] = outlines;
 
-  //  We are filling out 2 bytes at a time (int16_t), len is in bytes
-  //  If the current chunk of audio for the square wave is the crest of the wave,
-  //  this will add the volume, otherwise it is the trough of the wave, and will add "negative volume"
-  for (int i = 0; i < len / 2; i++) {
-    audio_data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ? config->volume : -config->volume;
+  uint32_t *pixels = (uint32_t *)malloc(width * height * sizeof(uint32_t));
+  if (!pixels) {
+    SDL_Log("Could not allocate outline texture\n");
+    return false;
+  }
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      const uint32_t cx = x % cell;
+      const uint32_t cy = y % cell;
+      pixels[y * width + x] = (cx == 0 || cy == 0 || cx == last || cy == last) ? border : 0;
+    }
   }
+  SDL_UpdateTexture(outlines, NULL, pixels, width * sizeof(uint32_t));
+  free(pixels);
+  return true;
 }
+
 // init sdl
 bool init_sdl(sdl_t *sdl, config_t *config) {
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) != 0) {
@@ -92,20 +696,40 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
     return false;
   }
 
-  sdl->renderer = SDL_CreateRenderer(sdl->window, -1, SDL_RENDERER_ACCELERATED);
+  sdl->renderer = SDL_CreateRenderer(sdl->window, -1, SDL_RENDERER_ACCELERATED | (config->vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 
   if (!sdl->renderer) {
     SDL_Log("Could not create Renderer %s\n", SDL_GetError());
     return false;
   }
 
+  sdl->screen = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 128, DISPLAY_ROWS);
+
+  if (!sdl->screen) {
+    SDL_Log("Could not create screen texture %s\n", SDL_GetError());
+    return false;
+  }
+  SDL_SetTextureBlendMode(sdl->screen, SDL_BLENDMODE_NONE);  // copy as is, BG COLOR alpha is 0
+
+  if (config->pixel_outlines && !(init_outline(sdl, config, false) && init_outline(sdl, config, true))) return false;
+
+  sdl->audio = (audio_t *)calloc(1, sizeof(audio_t));
+  if (!sdl->audio) {
+    SDL_Log("Could not allocate audio\n");
+    return false;
+  }
+  init_audio(sdl->audio, config);
+
   sdl->want = (SDL_AudioSpec){
-      .freq = 44100,           // 44100hz, CD квалитет
+      .freq = (int)config->audio_sample_rate,  // 44100hz, CD квалитет
       .format = AUDIO_S16LSB,  // 8 bit
       .channels = 1,           // моно аудио
-      .samples = 512,
+      .silence = 0,            // silence, padding and size are filled in by SDL
+      .samples = AUDIO_BLOCK,
+      .padding = 0,
+      .size = 0,
       .callback = audio_callback,
-      .userdata = config,
+      .userdata = sdl->audio,
   };
 
   sdl->dev = SDL_OpenAudioDevice(NULL, 0, &sdl->want, &sdl->have, 0);
@@ -119,8 +743,13 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
     SDL_Log("Could not get desired audio spec!\n");
     return false;
   }
+
+  // Never paused again, silence comes from the sound events
+  sdl->audio->latency = sdl->have.samples;
+  SDL_PauseAudioDevice(sdl->dev, 0);
   return true;  // Success
 }
+#endif
 
 // Почетна емулатор конфигурација од внесени аргументи
 bool set_config_from_args(config_t *config, const int argc, char **argv) {
@@ -136,18 +765,190 @@ bool set_config_from_args(config_t *config, const int argc, char **argv) {
       .square_wave_freq = 440,     // 440hz for middle A
       .audio_sample_rate = 44100,  // CD Quality
       .volume = 100,               // INT16_MAX would be max volume
+      .headless = false,           // Open SDL window/audio
+      .max_instructions = 0,       // No limit
+      .max_frames = 0,             // No limit
+      .engine = PREDECODE,         // Cached decode
+      .unthrottled = false,        // Real time 60hz ticks
+      .vsync = false,              // Present without waiting for the display refresh
+      .frame_skip = 0,             // Render every changed frame
+      .emu_thread = false,         // Input, emulation and rendering on the main thread
+      .seed = (uint32_t)time(NULL),
+      .roms = NULL,
+      .rom_count = 0,
+      .batch = false,
+      .instances = 1,
+      .threads = 0,  // std::thread::hardware_concurrency()
+      .lanes = false,
+      .load_state_file = NULL,
+      .save_state_file = NULL,
+      .rewind_seconds = 300,  // 5 minutes, a few MB
+      .trace_file = NULL,
+      .decode_trace_file = NULL,
+      .profile = false,
+      .bench = false,
+      .wav_file = NULL,
+      .keymap_file = NULL,
+      .record_file = NULL,
+      .replay_file = NULL,
+      .library_dir = NULL,
+      .rom_db_file = NULL,
+      .shm_name = NULL,
+      .ips_set = false,
   };
 
+  // Everything that isn't an option is a ROM, they stay in argv order in place
   for (int i = 1; i < argc; i++) {
-    // ...
-    (void)argv[i];
+    if (strncmp(argv[i], "--", 2) != 0) {
+      argv[config->rom_count++] = argv[i];
+      continue;
+    }
+
+    if (strcmp(argv[i], "--headless") == 0) {
+      config->headless = true;
+    } else if (strcmp(argv[i], "--max-inst") == 0 && i + 1 < argc) {
+      config->max_instructions = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc) {
+      config->max_frames = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+      config->inst_per_second = strtoul(argv[++i], NULL, 10);
+      config->ips_set = true;
+    } else if (strcmp(argv[i], "--vsync") == 0) {
+      config->vsync = true;
+    } else if (strcmp(argv[i], "--frame-skip") == 0 && i + 1 < argc) {
+      config->frame_skip = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--unthrottled") == 0) {
+      config->unthrottled = true;
+    } else if (strcmp(argv[i], "--emu-thread") == 0) {
+      config->emu_thread = true;
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      config->seed = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      config->batch = true;
+      config->headless = true;
+    } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+      config->instances = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      config->threads = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--lanes") == 0) {
+      config->lanes = true;
+    } else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+      config->load_state_file = argv[++i];
+    } else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc) {
+      config->save_state_file = argv[++i];
+    } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+      config->rewind_seconds = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      config->trace_file = argv[++i];
+    } else if (strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc) {
+      config->decode_trace_file = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      config->profile = true;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      config->bench = true;
+    } else if (strcmp(argv[i], "--wav") == 0 && i + 1 < argc) {
+      config->wav_file = argv[++i];
+    } else if (strcmp(argv[i], "--keymap") == 0 && i + 1 < argc) {
+      config->keymap_file = argv[++i];
+    } else if (strcmp(argv[i], "--library") == 0 && i + 1 < argc) {
+      config->library_dir = argv[++i];
+    } else if (strcmp(argv[i], "--rom-db") == 0 && i + 1 < argc) {
+      config->rom_db_file = argv[++i];
+    } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+      config->shm_name = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      config->record_file = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      config->replay_file = argv[++i];
+      config->headless = true;
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "interp") == 0) {
+        config->engine = INTERPRETER;
+      } else if (strcmp(argv[i], "predecode") == 0) {
+        config->engine = PREDECODE;
+      } else if (strcmp(argv[i], "threaded") == 0) {
+        config->engine = THREADED;
+      } else {
+        SDL_Log("Unknown engine %s, expected interp, predecode or threaded\n", argv[i]);
+        return false;
+      }
+    } else {
+      SDL_Log("Unknown argument %s\n", argv[i]);
+      return false;
+    }
+  }
+
+  config->roms = argv;
+  if (config->decode_trace_file || config->bench) return true;  // no ROM needed
+
+#ifdef NO_SDL
+  if (!config->headless) {
+    SDL_Log("Built without SDL, use --headless, --batch or --bench\n");
+    return false;
+  }
+#endif
+
+  if (config->rom_count == 0 || (config->rom_count > 1 && !config->batch)) {
+    SDL_Log("Expected one ROM, or any number of ROMs with --batch\n");
+    return false;
+  }
+
+  if (config->batch && (config->trace_file || config->profile)) {
+    SDL_Log("--trace and --profile can't be used with --batch\n");
+    return false;
+  }
+
+  if (config->lanes && !config->batch) {
+    SDL_Log("--lanes only applies to --batch\n");
+    return false;
+  }
+
+  if (config->shm_name && config->batch) {
+    SDL_Log("--shm exports a single machine, run one --headless process per segment\n");
+    return false;
+  }
+
+  if (config->wav_file && (!config->headless || config->batch)) {
+    SDL_Log("--wav renders a single --headless run\n");
+    return false;
+  }
+
+  if (config->emu_thread && config->profile) {
+    SDL_Log("--profile times the main loop, it can't be used with --emu-thread\n");
+    return false;
+  }
+
+  if (config->instances == 0) {
+    SDL_Log("--instances must be greater than 0\n");
+    return false;
+  }
+
+  if (config->inst_per_second == 0) {
+    SDL_Log("--ips must be greater than 0\n");
+    return false;
+  }
+
+  if (config->record_file && config->headless) {
+    SDL_Log("--record needs a window\n");
+    return false;
+  }
+
+  if (config->replay_file && (config->batch || config->load_state_file)) {
+    SDL_Log("--replay runs a single machine from the movie's own start state\n");
+    return false;
+  }
+
+  if (config->headless && !config->replay_file && !config->max_instructions && !config->max_frames) {
+    SDL_Log("Headless mode needs --max-inst or --max-frames\n");
+    return false;
   }
   return true;  // Success
 }
 
-// INIT Chip8 machine
-bool init_chip8(chip8_t *chip8, char rom_name[]) {
-  const uint32_t entry_point = 0x200;  // Chip8 Roms will be loaded to 0x200 aka memory location 512
+// INIT Chip8 machine from a ROM image in memory
+bool load_chip8(chip8_t *chip8, char rom_name[], const uint8_t *rom, const size_t rom_size) {
+  const uint32_t entry_point = ENTRY_POINT;
   const uint8_t font[] = {
       0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
       0x20, 0x60, 0x20, 0x20, 0x70,  // 1
@@ -166,735 +967,3415 @@ bool init_chip8(chip8_t *chip8, char rom_name[]) {
       0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
       0xF0, 0x80, 0xF0, 0x80, 0x80,  // F
   };
-  memset(chip8, 0, sizeof(chip8_t));
+  const uint8_t big_font[] = {
+      0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF,  // 0
+      0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF,  // 1
+      0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,  // 2
+      0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,  // 3
+      0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03,  // 4
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,  // 5
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,  // 6
+      0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18,  // 7
+      0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,  // 8
+      0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,  // 9
+      0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,  // A
+      0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC,  // B
+      0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C,  // C
+      0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,  // D
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,  // E
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0,  // F
+  };
+  memset(chip8, 0, sizeof(chip8_t));  // also empties the decode cache
 
-  // Load font
+  // Load font, SCHIP 8x10 font right after the 4x5 one
   memcpy(&chip8->ram[0], font, sizeof(font));
+  memcpy(&chip8->ram[BIG_FONT], big_font, sizeof(big_font));
 
-  // Open ROM File
-  FILE *rom = fopen(rom_name, "rb");
-  if (!rom) {
-    SDL_Log("Rom file %s is invalid or doesn't exist\n", rom_name);
-    return false;
-  }
-  fseek(rom, 0, SEEK_END);
-  const size_t rom_size = ftell(rom);
   const size_t max_size = sizeof chip8->ram - entry_point;
-  rewind(rom);
-
   if (rom_size > max_size) {
     SDL_Log("Rom file is too big, max size allowed is %zu.\n", max_size);
     return false;
   }
-
-  fread(&chip8->ram[entry_point], rom_size, 1, rom);
-
-  fclose(rom);
+  if (rom_size) memcpy(&chip8->ram[entry_point], rom, rom_size);  // an empty file has no mapping
 
   // Set chip8 machine defaul
   chip8->state = RUNNING;  // DEFAULT STATE = RUNNING
   chip8->PC = entry_point;
   chip8->rom_name = rom_name;
   chip8->stack_ptr = &chip8->stack[0];
+  chip8->pitch = 64;  // 4000hz
+  chip8->decode = quirk_decoder(default_quirks);
+  chip8->plane_mask = 1;
+  chip8->dirty = ~0ULL;
+  chip8->draw = true;
 
   return true;
 }
 
-// final cleanup
-void final_cleanup(const sdl_t sdl) {
-  SDL_DestroyRenderer(sdl.renderer);
-  SDL_DestroyWindow(sdl.window);
-  SDL_CloseAudioDevice(sdl.dev);
-  SDL_Quit();
-}
-
-// Init Screen Clear to background color
-void clear_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
-  memset(&chip8->display[0], false, sizeof chip8->display);
-  memset(&chip8->keypad[0], false, sizeof chip8->keypad);
+// ROM library: every file of a directory that fits in RAM, plus the ROMs named on the command line.
+// The array is sized once up front so rom_t pointers stay valid
+typedef struct {
+  rom_t *roms;
+  uint32_t count;
+  uint32_t capacity;
+  rom_t **by_hash;   // roms sorted by content hash, built on the first lookup by hash
+  uint32_t indexed;  // roms in by_hash, rebuilt once ROMs were added since
+} rom_library_t;
 
-  const uint8_t r = (config.bg_color >> 24) & 0xFF;
-  const uint8_t g = (config.bg_color >> 16) & 0xFF;
-  const uint8_t b = (config.bg_color >> 8) & 0xFF;
-  const uint8_t a = (config.bg_color >> 0) & 0xFF;
+typedef struct {
+  rom_settings_t *entries;  // sorted by hash
+  uint32_t count;
+} rom_db_t;
 
-  SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-  SDL_RenderClear(sdl.renderer);
+// FNV-1a, same as display_hash
+uint64_t rom_hash(rom_t *rom) {
+  if (!rom->hashed) {
+    rom->hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < rom->size; i++) {
+      rom->hash ^= rom->data[i];
+      rom->hash *= 0x100000001B3ULL;
+    }
+    rom->hashed = true;
+  }
+  return rom->hash;
 }
 
-void update_screen(const sdl_t sdl, const chip8_t chip8, const config_t config) {
-  SDL_Rect rect = {.x = 0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
-
-  const uint8_t fg_r = (config.fg_color >> 24) & 0xFF;
-  const uint8_t fg_g = (config.fg_color >> 16) & 0xFF;
-  const uint8_t fg_b = (config.fg_color >> 8) & 0xFF;
-  const uint8_t fg_a = (config.fg_color >> 0) & 0xFF;
-
-  const uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
-  const uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
-  const uint8_t bg_b = (config.bg_color >> 8) & 0xFF;
-  const uint8_t bg_a = (config.bg_color >> 0) & 0xFF;
-
-  // Помини низ сите пиксели, цртај правоаголник по пиксел на SDL window
-  for (uint32_t i = 0; i < sizeof chip8.display; i++) {
-    // Транслација 1D индекс i вредност во 2D X/Y координати
-    // X = i % window_width
-    // Y = i / window_width
-    rect.x = (i % config.window_width) * config.scale_factor;
-    rect.y = (i / config.window_width) * config.scale_factor;
-
-    if (chip8.display[i]) {
-      // Ако пикселот е вклучен, искористи fg_color
-      SDL_SetRenderDrawColor(sdl.renderer, fg_r, fg_g, fg_b, fg_a);
-      SDL_RenderFillRect(sdl.renderer, &rect);
-
-      // Ако pixel_outline е true цртај ги пикселите поинаку
-      if (config.pixel_outlines) {
-        SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b,
-                               bg_a);  // BG COLOR се користи за да се направи
-                                       // црн outline околу секој пиксел
-        SDL_RenderDrawRect(sdl.renderer, &rect);
-      }
-    } else {
-      // Пикселот е исклучен, искористи bg_color
-      SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-      SDL_RenderFillRect(sdl.renderer, &rect);
+// Map a ROM file read only. Resets and instances copy from the mapping, the file is only opened here
+bool map_rom(rom_t *rom, const char *path) {
+  const size_t max_size = 4096 - ENTRY_POINT;
+  memset(rom, 0, sizeof *rom);
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER size;
+  if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    SDL_Log("Rom file %s is invalid or doesn't exist\n", path);
+    return false;
+  }
+  rom->size = (size_t)size.QuadPart;
+  if (rom->size > 0 && rom->size <= max_size) {
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      rom->data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);  // the view keeps it alive
     }
   }
-  SDL_RenderPresent(sdl.renderer);
+  CloseHandle(file);
+#else
+  const int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    if (fd >= 0) close(fd);
+    SDL_Log("Rom file %s is invalid or doesn't exist\n", path);
+    return false;
+  }
+  rom->size = (size_t)info.st_size;
+  if (rom->size > 0 && rom->size <= max_size) {
+    void *data = mmap(NULL, rom->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) rom->data = (const uint8_t *)data;
+  }
+  close(fd);
+#endif
+  if (rom->size > max_size) {
+    SDL_Log("Rom file %s is too big, max size allowed is %zu.\n", path, max_size);
+    return false;
+  }
+  if (rom->size > 0 && !rom->data) {
+    SDL_Log("Could not map rom file %s\n", path);
+    return false;
+  }
+  rom->path = strdup(path);
+  return rom->path != NULL;
 }
-// USER INPUT
-// CHIP8 Keypad QWERTY
-// 123C         1234
-// 456D		  	QWER
-// 789E		   	ASDF
-// A0BF         ZXCV
-void handle_input(chip8_t *chip8) {
-  SDL_Event event;
 
-  while (SDL_PollEvent(&event)) switch (event.type) {
-      case SDL_QUIT:
-        chip8->state = QUIT;  // EXIT EMULATOR LOOP
-        return;
-      case SDL_KEYDOWN:
-        switch (event.key.keysym.sym) {
-          case SDLK_ESCAPE:
-            chip8->state = QUIT;
-            puts("==== EXIT BUTTON ====");
-            break;
-          case SDLK_SPACE:
-            if (chip8->state == RUNNING) {
-              chip8->state = PAUSED;
-              puts("==== PAUSED ====");
-            } else {
-              chip8->state = RUNNING;
-              puts("==== RESUME ====");
-            }
-            break;
+void unmap_rom(rom_t *rom) {
+  if (rom->data) {
+#ifdef _WIN32
+    UnmapViewOfFile(rom->data);
+#else
+    munmap((void *)rom->data, rom->size);
+#endif
+  }
+  free(rom->path);
+}
 
-          case SDLK_TAB:
-            // RESET ROM
-            init_chip8(chip8, chip8->rom_name);
-            break;
+// Map every file in dir that fits in RAM (NULL = no library), with room for extra ROMs from the command line
+bool open_library(rom_library_t *library, const char *dir, const uint32_t extra) {
+  std::error_code error;
+  uint32_t files = 0;
+  if (dir) {
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(dir, error)) files += entry.is_regular_file(error);
+    if (error) {
+      SDL_Log("Could not read rom library %s: %s\n", dir, error.message().c_str());
+      return false;
+    }
+  }
 
-          case SDLK_1: chip8->keypad[0x1] = true; break;
-          case SDLK_2: chip8->keypad[0x2] = true; break;
-          case SDLK_3: chip8->keypad[0x3] = true; break;
-          case SDLK_4: chip8->keypad[0xC] = true; break;
+  library->capacity = files + extra;
+  library->count = 0;
+  library->roms = (rom_t *)calloc(library->capacity ? library->capacity : 1, sizeof(rom_t));
+  if (!library->roms) {
+    SDL_Log("Could not allocate the rom library\n");
+    return false;
+  }
+  if (!dir) return true;
 
-          case SDLK_q: chip8->keypad[0x4] = true; break;
-          case SDLK_w: chip8->keypad[0x5] = true; break;
-          case SDLK_e: chip8->keypad[0x6] = true; break;
-          case SDLK_r: chip8->keypad[0xD] = true; break;
+  for (const auto &entry : std::filesystem::recursive_directory_iterator(dir, error)) {
+    if (library->count == files) break;  // directory grew since it was counted
+    if (!entry.is_regular_file(error) || entry.file_size(error) > 4096 - ENTRY_POINT) continue;  // not a ROM
+    if (map_rom(&library->roms[library->count], entry.path().string().c_str())) library->count++;
+  }
+  return true;
+}
 
-          case SDLK_a: chip8->keypad[0x7] = true; break;
-          case SDLK_s: chip8->keypad[0x8] = true; break;
-          case SDLK_d: chip8->keypad[0x9] = true; break;
-          case SDLK_f: chip8->keypad[0xE] = true; break;
+void close_library(rom_library_t *library) {
+  for (uint32_t i = 0; i < library->count; i++) unmap_rom(&library->roms[i]);
+  free(library->roms);
+  free(library->by_hash);
+}
 
-          case SDLK_z: chip8->keypad[0xA] = true; break;
-          case SDLK_x: chip8->keypad[0x0] = true; break;
-          case SDLK_c: chip8->keypad[0xB] = true; break;
-          case SDLK_v: chip8->keypad[0xF] = true; break;
+// qsort/bsearch order of rom_settings_t by hash, a hash key compares as the first member
+int compare_settings(const void *a, const void *b) {
+  const uint64_t x = ((const rom_settings_t *)a)->hash, y = ((const rom_settings_t *)b)->hash;
+  return (x > y) - (x < y);
+}
 
-          default: break;
-        }
-        break;
-      case SDL_KEYUP:
-        switch (event.key.keysym.sym) {
-          case SDLK_1: chip8->keypad[0x1] = false; break;
-          case SDLK_2: chip8->keypad[0x2] = false; break;
-          case SDLK_3: chip8->keypad[0x3] = false; break;
-          case SDLK_4: chip8->keypad[0xC] = false; break;
-
-          case SDLK_q: chip8->keypad[0x4] = false; break;
-          case SDLK_w: chip8->keypad[0x5] = false; break;
-          case SDLK_e: chip8->keypad[0x6] = false; break;
-          case SDLK_r: chip8->keypad[0xD] = false; break;
-
-          case SDLK_a: chip8->keypad[0x7] = false; break;
-          case SDLK_s: chip8->keypad[0x8] = false; break;
-          case SDLK_d: chip8->keypad[0x9] = false; break;
-          case SDLK_f: chip8->keypad[0xE] = false; break;
-
-          case SDLK_z: chip8->keypad[0xA] = false; break;
-          case SDLK_x: chip8->keypad[0x0] = false; break;
-          case SDLK_c: chip8->keypad[0xB] = false; break;
-          case SDLK_v: chip8->keypad[0xF] = false; break;
-
-          default: break;
-        }
-      default: break;
-    }
+// qsort/bsearch order of rom_t * by content hash, the key is a rom_t * too
+int compare_rom_hash(const void *a, const void *b) {
+  const uint64_t x = (*(rom_t *const *)a)->hash, y = (*(rom_t *const *)b)->hash;
+  return (x > y) - (x < y);
 }
 
-#ifdef DEBUG
-void print_debug_info(chip8_t *chip8, const config_t config) {
-  printf("Address: 0x%04X, Opcode: 0x%04X Desc:", chip8->PC - 2, chip8->inst.opcode);
-  switch ((chip8->inst.opcode >> 12) & 0x0F) {
-    case 0x00:
-      if (chip8->inst.NN == 0xE0) {
-        // 0x00E0: Clear the screen
-        printf("Clean screen\n");
-      } else if (chip8->inst.NN == 0xEE) {
-        // 0x00EE: Return from subroutine
-        // Set program counter to last address on subroutine stack so that next
-        // opcode will be gotten from that address
-        printf("Return from subroutine to address 0x%04X\n", *(chip8->stack_ptr - 1));
-      } else {
-        printf("Unimplemented Opcode.\n");
-      }
+const rom_settings_t *find_rom_settings(const rom_db_t *db, const uint64_t hash) {
+  if (!db->count) return NULL;
+  rom_settings_t key = {};
+  key.hash = hash;
+  return (const rom_settings_t *)bsearch(&key, db->entries, db->count, sizeof(rom_settings_t), compare_settings);
+}
 
-      break;
-    case 0x01: {
-      // 0x1NNN: Jump to address NNN
-      printf("Jump to address NNN (0x%04X)\n",
-             chip8->inst.NNN);  // Set PC so that next opcode is from NNN.
-      break;
+// Library ROM with this content hash. Hashes every ROM and sorts them the first time (and after ROMs were added)
+rom_t *find_rom_by_hash(rom_library_t *library, const uint64_t hash) {
+  if (library->indexed != library->count || !library->by_hash) {
+    rom_t **by_hash = (rom_t **)realloc(library->by_hash, (library->count ? library->count : 1) * sizeof(rom_t *));
+    if (!by_hash) {
+      SDL_Log("Could not allocate the rom index\n");
+      return NULL;
     }
-    case 0x02: {
-      //
-      printf("SET Program Counter PC to NNN (0x%04X)\n", chip8->inst.NNN);
-      break;
+    library->by_hash = by_hash;
+    for (uint32_t i = 0; i < library->count; i++) {
+      rom_hash(&library->roms[i]);
+      by_hash[i] = &library->roms[i];
     }
-    case 0x03: {
-      // 0x3NNN: Skips the next instruction if VX equals NN (usually the next
-      // instruction is a jump to skip a code block)
-      printf(
-          "Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if "
-          "true.\n",
-          chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-      break;
+    qsort(by_hash, library->count, sizeof(rom_t *), compare_rom_hash);
+    library->indexed = library->count;
+  }
+  rom_t key_rom = {};
+  key_rom.hash = hash;
+  rom_t *key = &key_rom;
+  rom_t **found = (rom_t **)bsearch(&key, library->by_hash, library->indexed, sizeof(rom_t *), compare_rom_hash);
+  return found ? *found : NULL;
+}
+
+// A ROM by content hash (16 hex digits) or file name in the library, otherwise the file at that path,
+// which is mapped and added. Settings come from db for either
+rom_t *find_rom(rom_library_t *library, const rom_db_t *db, const char *name) {
+  rom_t *rom = NULL;
+  char *end;
+  const uint64_t hash = strtoull(name, &end, 16);
+  const bool is_hash = strlen(name) == 16 && *end == '\0';
+
+  if (is_hash) rom = find_rom_by_hash(library, hash);
+  for (uint32_t i = 0; i < library->count && !rom; i++) {
+    rom_t *candidate = &library->roms[i];
+    const char *file = candidate->path + strlen(candidate->path);
+    while (file > candidate->path && file[-1] != '/' && file[-1] != '\\') file--;
+    if (strcmp(candidate->path, name) == 0 || strcmp(file, name) == 0) rom = candidate;
+  }
+  if (!rom) {
+    if (library->count == library->capacity) {
+      SDL_Log("Rom %s is not in the library\n", name);
+      return NULL;
     }
-    case 0x04: {
-      // 0x4NNN: Skips the next instruction if VX doesn't equal NN (usually the
-      // next instruction is a jump to skip a code block)
-      printf(
-          "Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if "
-          "true.\n",
-          chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-      break;
+    if (!map_rom(&library->roms[library->count], name)) return NULL;
+    rom = &library->roms[library->count++];
+  }
+  rom->settings = find_rom_settings(db, rom_hash(rom));
+  return rom;
+}
+
+// "<hash> key=value..." per line, # starts a comment. Keys: shift, load_store, jump, clip (0/1), ips,
+// fg, bg (RRGGBBAA hex) and keymap (file)
+bool load_rom_db(rom_db_t *db, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    SDL_Log("Rom database %s is invalid or does not exist\n", path);
+    return false;
+  }
+  char line[1024];
+  bool ok = true;
+  for (uint32_t line_no = 1; ok && fgets(line, sizeof line, file); line_no++) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char *token = strtok(line, " \t\r\n");
+    if (!token) continue;
+
+    char *end;
+    rom_settings_t settings = {};
+    settings.hash = strtoull(token, &end, 16);
+    settings.quirks = default_quirks;
+    ok = strlen(token) == 16 && *end == '\0';
+    for (token = strtok(NULL, " \t\r\n"); ok && token; token = strtok(NULL, " \t\r\n")) {
+      char *value = strchr(token, '=');
+      if (!value) {
+        ok = false;
+        break;
+      }
+      *value++ = '\0';
+      if (strcmp(token, "shift") == 0) {
+        settings.quirks.shift = atoi(value);
+      } else if (strcmp(token, "load_store") == 0) {
+        settings.quirks.load_store = atoi(value);
+      } else if (strcmp(token, "jump") == 0) {
+        settings.quirks.jump = atoi(value);
+      } else if (strcmp(token, "clip") == 0) {
+        settings.quirks.clip = atoi(value);
+      } else if (strcmp(token, "ips") == 0) {
+        settings.inst_per_second = strtoul(value, NULL, 10);
+      } else if (strcmp(token, "fg") == 0) {
+        settings.fg_color = strtoul(value, NULL, 16);
+        settings.colors_set[0] = true;
+      } else if (strcmp(token, "bg") == 0) {
+        settings.bg_color = strtoul(value, NULL, 16);
+        settings.colors_set[1] = true;
+      } else if (strcmp(token, "keymap") == 0) {
+        settings.keymap_file = strdup(value);
+      } else {
+        ok = false;
+      }
+    }
+    if (!ok) {
+      SDL_Log("%s:%u: expected <hash> followed by shift, load_store, jump, clip, ips, fg, bg or keymap=<value>\n", path, line_no);
+      free(settings.keymap_file);
+      break;
     }
-    case 0x05: {
-      // 0x4NNN: Skips the next instruction if VX equals VY (usually the next
-      // instruction is a jump to skip a code block)
-      printf(
-          "Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if "
-          "true.\n",
-          chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
+
+    rom_settings_t *entries = (rom_settings_t *)realloc(db->entries, (db->count + 1) * sizeof(rom_settings_t));
+    if (!entries) {
+      SDL_Log("Could not allocate the rom database\n");
+      free(settings.keymap_file);
+      ok = false;
       break;
     }
-    case 0x06: {
-      // 0x6XNN: Set register VX to NN
-      printf("Set register V%X to NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
+    db->entries = entries;
+    db->entries[db->count++] = settings;
+  }
+  fclose(file);
+
+  // Looked up by binary search, a hash can only have one entry
+  if (ok && db->count) qsort(db->entries, db->count, sizeof(rom_settings_t), compare_settings);
+  for (uint32_t i = 1; ok && i < db->count; i++) {
+    if (db->entries[i].hash == db->entries[i - 1].hash) {
+      SDL_Log("%s: %016llx is listed more than once\n", path, (unsigned long long)db->entries[i].hash);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+void free_rom_db(rom_db_t *db) {
+  for (uint32_t i = 0; i < db->count; i++) free(db->entries[i].keymap_file);
+  free(db->entries);
+}
+
+// The ROM's clock speed, colors and keymap, unless the command line already chose them
+void apply_rom_settings(config_t *config, const rom_settings_t *settings) {
+  if (!settings) return;
+  if (settings->inst_per_second && !config->ips_set) config->inst_per_second = settings->inst_per_second;
+  if (settings->colors_set[0]) config->fg_color = settings->fg_color;
+  if (settings->colors_set[1]) config->bg_color = settings->bg_color;
+  if (settings->keymap_file && !config->keymap_file) config->keymap_file = settings->keymap_file;
+}
+
+// INIT Chip8 machine from a mapped ROM
+bool init_chip8(chip8_t *chip8, const rom_t *rom) {
+  if (!load_chip8(chip8, rom->path, rom->data, rom->size)) return false;
+  chip8->rom = rom;
+  if (rom->settings) chip8->decode = quirk_decoder(rom->settings->quirks);
+  return true;
+}
+
+// (Re)start the machine's CXNN random sequence
+void seed_chip8(chip8_t *chip8, const uint32_t seed) {
+  chip8->seed = seed;
+  chip8->rng = seed ? seed : 0x2545F491;  // xorshift state must never be 0
+}
+
+uint8_t *put_le(uint8_t *p, const uint64_t value, const uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) *p++ = (value >> (8 * i)) & 0xFF;
+  return p;
+}
+
+uint64_t get_le(const uint8_t **p, const uint8_t bytes) {
+  uint64_t value = 0;
+  for (uint8_t i = 0; i < bytes; i++) value |= (uint64_t)*(*p)++ << (8 * i);
+  return value;
+}
+
+// Serialize the machine into buf (SAVE_STATE_SIZE bytes)
+void save_state(const chip8_t *chip8, uint8_t *buf) {
+  uint8_t *p = buf;
+  memcpy(p, "C8ST", 4);
+  p += 4;
+  p = put_le(p, SAVE_STATE_VERSION, 2);
+  p = put_le(p, chip8->PC, 2);
+  p = put_le(p, chip8->I, 2);
+  for (uint8_t i = 0; i < 16; i++) *p++ = chip8->V[i];
+  *p++ = chip8->stack_ptr - chip8->stack;
+  for (uint8_t i = 0; i < 12; i++) p = put_le(p, chip8->stack[i], 2);
+  *p++ = chip8->delay_timer;
+  *p++ = chip8->sound_timer;
+
+  uint16_t keys = 0;
+  for (uint8_t i = 0; i < 16; i++) keys |= chip8->keypad[i] << i;
+  p = put_le(p, keys, 2);
+
+  p = put_le(p, chip8->seed, 4);
+  p = put_le(p, chip8->rng, 4);
+  p = put_le(p, chip8->cycles, 8);
+  p = put_le(p, chip8->frames, 8);
+  *p++ = chip8->pitch;
+  *p++ = chip8->pattern_loaded;
+  memcpy(p, chip8->audio_pattern, sizeof chip8->audio_pattern);
+  p += sizeof chip8->audio_pattern;
+  *p++ = chip8->display.hires;
+  *p++ = chip8->plane_mask;
+  const uint64_t *words = &chip8->display.planes[0][0][0];
+  for (uint32_t i = 0; i < DISPLAY_WORDS; i++) p = put_le(p, words[i], 8);
+  memcpy(p, chip8->ram, sizeof chip8->ram);
+}
+
+// Restore a save state, the machine is left untouched if buf isn't a valid state
+bool load_state(chip8_t *chip8, const uint8_t *buf, const size_t len) {
+  const uint8_t *p = buf;
+  if (len < 6 || memcmp(p, "C8ST", 4) != 0) {
+    SDL_Log("Not a save state\n");
+    return false;
+  }
+  p += 4;
+  if (get_le(&p, 2) != SAVE_STATE_VERSION) {
+    SDL_Log("Unsupported save state version\n");
+    return false;
+  }
+  if (len != SAVE_STATE_SIZE) {
+    SDL_Log("Not a save state\n");
+    return false;
+  }
+  if (buf[4 + 2 + 2 + 2 + 16] > 12) {
+    SDL_Log("Corrupt save state, stack pointer out of range\n");
+    return false;
+  }
+
+  chip8->PC = get_le(&p, 2);
+  chip8->I = get_le(&p, 2);
+  for (uint8_t i = 0; i < 16; i++) chip8->V[i] = *p++;
+  chip8->stack_ptr = &chip8->stack[*p++];
+  for (uint8_t i = 0; i < 12; i++) chip8->stack[i] = get_le(&p, 2);
+  chip8->delay_timer = *p++;
+  chip8->sound_timer = *p++;
+
+  const uint16_t keys = get_le(&p, 2);
+  for (uint8_t i = 0; i < 16; i++) chip8->keypad[i] = (keys >> i) & 1;
+
+  chip8->seed = get_le(&p, 4);
+  chip8->rng = get_le(&p, 4);
+  chip8->cycles = get_le(&p, 8);
+  chip8->frames = get_le(&p, 8);
+  chip8->pitch = *p++;
+  chip8->pattern_loaded = *p++;
+  memcpy(chip8->audio_pattern, p, sizeof chip8->audio_pattern);
+  p += sizeof chip8->audio_pattern;
+  chip8->display.hires = *p++;
+  chip8->plane_mask = *p++ & 0x0F;
+  uint64_t *words = &chip8->display.planes[0][0][0];
+  for (uint32_t i = 0; i < DISPLAY_WORDS; i++) words[i] = get_le(&p, 8);
+  chip8->dirty = ~0ULL;  // redraw everything
+  chip8->draw = true;
+  memcpy(chip8->ram, p, sizeof chip8->ram);
+
+  // RAM was replaced wholesale, everything predecoded from it is stale
+  memset(chip8->decode_cache, 0, sizeof chip8->decode_cache);
+  memset(chip8->block_len, 0, sizeof chip8->block_len);
+  return true;
+}
+
+bool save_state_file(const chip8_t *chip8, const char *path) {
+  uint8_t buf[SAVE_STATE_SIZE];
+  save_state(chip8, buf);
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    SDL_Log("Could not open save state %s for writing\n", path);
+    return false;
+  }
+  const bool ok = fwrite(buf, sizeof buf, 1, file) == 1;
+  fclose(file);
+  if (!ok) SDL_Log("Could not write save state %s\n", path);
+  return ok;
+}
+
+bool load_state_file(chip8_t *chip8, const char *path) {
+  uint8_t buf[SAVE_STATE_SIZE + 1];  // one extra byte to notice oversized files
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    SDL_Log("Save state %s is invalid or doesn't exist\n", path);
+    return false;
+  }
+  const size_t len = fread(buf, 1, sizeof buf, file);
+  fclose(file);
+  return load_state(chip8, buf, len);
+}
+
+// Start recording into path from the machine as it is now
+bool start_recording(movie_t *movie, const char *path, const chip8_t *chip8, const config_t *config) {
+  uint8_t header[MOVIE_HEADER_SIZE + SAVE_STATE_SIZE];
+  uint8_t *p = header;
+  memcpy(p, "C8MV", 4);
+  p += 4;
+  p = put_le(p, MOVIE_VERSION, 2);
+  p = put_le(p, config->inst_per_second, 4);
+  *p++ = config->engine;
+  const quirks_t quirks = chip8->rom && chip8->rom->settings ? chip8->rom->settings->quirks : default_quirks;
+  *p++ = (quirks.shift ? QUIRK_SHIFT : 0) | (quirks.load_store ? QUIRK_LOAD_STORE : 0) | (quirks.jump ? QUIRK_JUMP : 0) |
+         (quirks.clip ? QUIRK_CLIP : 0);
+  p = put_le(p, 0, 4);  // frames, filled in by stop_recording
+  p = put_le(p, SAVE_STATE_SIZE, 4);
+  save_state(chip8, p);
+
+  memset(movie, 0, sizeof *movie);
+  movie->ips = config->inst_per_second;
+  movie->frame_cycles = chip8->cycles;
+  movie->file = fopen(path, "wb");
+  if (!movie->file) {
+    SDL_Log("Could not open movie %s for writing\n", path);
+    return false;
+  }
+  if (fwrite(header, sizeof header, 1, movie->file) != 1) {
+    SDL_Log("Could not write movie %s\n", path);
+    fclose(movie->file);
+    return false;
+  }
+  return true;
+}
+
+void record_movie(movie_t *movie, const chip8_t *chip8, const movie_event_type_t type, const uint8_t key) {
+  uint8_t record[MOVIE_RECORD_SIZE];
+  uint8_t *p = record;
+  p = put_le(p, movie->frame, 4);
+  p = put_le(p, chip8->cycles - movie->frame_cycles, 4);
+  *p++ = type;
+  *p++ = key;
+  fwrite(record, sizeof record, 1, movie->file);
+}
+
+// Called after every emulated frame (instructions + timers) while recording or replaying
+void movie_frame(movie_t *movie, const chip8_t *chip8) {
+  movie->frame++;
+  movie->frame_cycles = chip8->cycles;
+}
+
+bool stop_recording(movie_t *movie) {
+  uint8_t frames[4];
+  put_le(frames, movie->frame, 4);
+  const bool ok = fseek(movie->file, MOVIE_FRAMES_OFFSET, SEEK_SET) == 0 && fwrite(frames, sizeof frames, 1, movie->file) == 1;
+  if (fclose(movie->file) != 0 || !ok) {
+    SDL_Log("Could not finish the movie\n");
+    return false;
+  }
+  printf("==== RECORDED %u FRAMES ====\n", movie->frame);
+  return true;
+}
+
+// Read a movie and put chip8 (already loaded with the same ROM) in its starting state, decoding with the recorded quirks
+bool load_movie(movie_t *movie, const char *path, chip8_t *chip8) {
+  memset(movie, 0, sizeof *movie);
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    SDL_Log("Movie %s is invalid or doesn't exist\n", path);
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *data = size > 0 ? (uint8_t *)malloc(size) : NULL;
+  const bool read = data && fread(data, size, 1, file) == 1;
+  fclose(file);
+
+  const uint8_t *p = data;
+  bool ok = read && size >= MOVIE_HEADER_SIZE && memcmp(p, "C8MV", 4) == 0;
+  if (ok) {
+    p += 4;
+    ok = get_le(&p, 2) == MOVIE_VERSION;
+  }
+  if (ok) {
+    movie->ips = get_le(&p, 4);
+    const uint8_t engine = *p++;
+    const uint8_t quirks = *p++;
+    movie->engine = (emu_engine_t)engine;
+    movie->quirks = {.shift = (quirks & QUIRK_SHIFT) != 0,
+                     .load_store = (quirks & QUIRK_LOAD_STORE) != 0,
+                     .jump = (quirks & QUIRK_JUMP) != 0,
+                     .clip = (quirks & QUIRK_CLIP) != 0};
+    movie->frames = get_le(&p, 4);
+    const uint32_t state_size = get_le(&p, 4);
+    ok = movie->ips && engine <= THREADED && quirks < 0x10 && state_size <= (uint64_t)size - MOVIE_HEADER_SIZE &&
+         (size - MOVIE_HEADER_SIZE - state_size) % MOVIE_RECORD_SIZE == 0 && load_state(chip8, p, state_size);
+    p += state_size;
+  }
+  if (ok) {
+    movie->event_count = (data + size - p) / MOVIE_RECORD_SIZE;
+    movie->events = (movie_event_t *)malloc((movie->event_count + 1) * sizeof(movie_event_t));
+    ok = movie->events != NULL;
+  }
+  for (uint32_t i = 0; ok && i < movie->event_count; i++) {
+    movie->events[i].frame = get_le(&p, 4);
+    movie->events[i].inst = get_le(&p, 4);
+    movie->events[i].type = *p++;
+    movie->events[i].key = *p++ & 0x0F;
+  }
+  free(data);
+  if (!ok) SDL_Log("Movie %s is invalid or from another version\n", path);
+  chip8->decode = quirk_decoder(movie->quirks);
+  movie->frame_cycles = chip8->cycles;
+  return ok;
+}
+
+bool init_rewind(session_t *session, const uint32_t seconds) {
+  session->rewind_groups = (seconds * 60 + REWIND_GROUP_FRAMES - 1) / REWIND_GROUP_FRAMES;
+  if (session->rewind_groups == 0) return true;  // rewind off
+
+  session->rewind = (rewind_group_t *)calloc(session->rewind_groups, sizeof(rewind_group_t));
+  if (!session->rewind) {
+    SDL_Log("Could not allocate rewind history\n");
+    return false;
+  }
+  return true;
+}
+
+void free_rewind(session_t *session) {
+  for (uint32_t i = 0; i < session->rewind_groups && session->rewind; i++) free(session->rewind[i].data);
+  free(session->rewind);
+}
+
+// XOR state against keyframe and run length encode it at out, returns the encoded size
+uint32_t encode_delta(const uint8_t *state, const uint8_t *keyframe, uint8_t *out) {
+  uint8_t *p = out;
+
+  for (uint32_t i = 0; i < SAVE_STATE_SIZE;) {
+    uint32_t zeros = 0;
+    while (i + zeros < SAVE_STATE_SIZE && state[i + zeros] == keyframe[i + zeros]) zeros++;
+    i += zeros;
+
+    // Literal run until 4 unchanged bytes in a row, shorter gaps are cheaper inline than a new header
+    uint32_t literals = 0;
+    for (uint32_t same = 0; i + literals < SAVE_STATE_SIZE && same < 4; literals++) {
+      same = (state[i + literals] == keyframe[i + literals]) ? same + 1 : 0;
+    }
+    while (literals && state[i + literals - 1] == keyframe[i + literals - 1]) literals--;
+
+    p = put_le(p, zeros, 2);
+    p = put_le(p, literals, 2);
+    for (uint32_t j = 0; j < literals; j++) *p++ = state[i + j] ^ keyframe[i + j];
+    i += literals;
+  }
+  return p - out;
+}
+
+void decode_delta(const uint8_t *delta, const uint8_t *keyframe, uint8_t *state) {
+  memcpy(state, keyframe, SAVE_STATE_SIZE);
+
+  for (uint32_t i = 0; i < SAVE_STATE_SIZE;) {
+    i += get_le(&delta, 2);
+    const uint32_t literals = get_le(&delta, 2);
+    for (uint32_t j = 0; j < literals; j++) state[i++] ^= *delta++;
+  }
+}
+
+// Record the machine at the end of a frame
+void record_rewind(session_t *session, const chip8_t *chip8) {
+  if (!session->rewind) return;
+
+  uint8_t state[SAVE_STATE_SIZE];
+  save_state(chip8, state);
+
+  // A full (or no) group: this frame starts the next one with a keyframe, recycling the oldest if the ring is full
+  const bool new_group = session->rewind_count == 0 || session->rewind[session->rewind_head].frames == REWIND_GROUP_FRAMES;
+  const uint32_t head = session->rewind_count ? (session->rewind_head + new_group) % session->rewind_groups : session->rewind_head;
+  rewind_group_t *group = &session->rewind[head];
+
+  // Worst case: all literals plus a header. Nothing changes until there is room
+  const uint32_t needed = (new_group ? 0 : group->size) + SAVE_STATE_SIZE + 4;
+  if (needed > group->capacity) {
+    const uint32_t capacity = needed + SAVE_STATE_SIZE;
+    uint8_t *data = (uint8_t *)realloc(group->data, capacity);
+    if (!data) return;  // skip the frame, history just gets coarser
+    group->data = data;
+    group->capacity = capacity;
+  }
+
+  if (new_group) {
+    session->rewind_head = head;
+    if (session->rewind_count < session->rewind_groups) session->rewind_count++;
+    group->size = 0;
+    group->frames = 0;
+  }
+
+  group->offsets[group->frames] = group->size;
+  if (group->frames == 0) {
+    memcpy(group->data, state, SAVE_STATE_SIZE);
+    group->size = SAVE_STATE_SIZE;
+  } else {
+    group->size += encode_delta(state, group->data, &group->data[group->size]);
+  }
+  group->frames++;
+}
+
+// Drop the newest recorded frame and restore the one before it, the oldest frame is never dropped
+bool rewind_step(session_t *session, chip8_t *chip8) {
+  if (!session->rewind_count) return false;
+
+  rewind_group_t *group = &session->rewind[session->rewind_head];
+  if (group->frames > 1) {
+    group->frames--;
+    group->size = group->offsets[group->frames];
+  } else if (session->rewind_count > 1) {
+    group->frames = 0;
+    group->size = 0;
+    session->rewind_head = (session->rewind_head + session->rewind_groups - 1) % session->rewind_groups;
+    session->rewind_count--;
+    group = &session->rewind[session->rewind_head];
+  }
+
+  const uint8_t frame = group->frames - 1;
+  if (frame == 0) return load_state(chip8, group->data, SAVE_STATE_SIZE);
+
+  uint8_t state[SAVE_STATE_SIZE];
+  decode_delta(&group->data[group->offsets[frame]], group->data, state);
+  return load_state(chip8, state, SAVE_STATE_SIZE);
+}
+
+// Color index of the display pixel at x,y: bit p set = lit in plane p. Rows are MSB first
+uint8_t get_pixel(const display_t *display, const uint32_t x, const uint32_t y) {
+  uint8_t color = 0;
+  for (uint8_t p = 0; p < DISPLAY_PLANES; p++) color |= ((display->planes[p][y][x >> 6] >> (63 - (x & 63))) & 1) << p;
+  return color;
+}
+
+// Drop predecoded instructions overlapping RAM bytes [addr, addr + len), called after every RAM write.
+// An instruction starting at addr - 1 includes the byte at addr, so it goes too,
+// as does every translated block that could reach addr (started at most MAX_BLOCK_LEN * 2 - 1 bytes before it).
+void invalidate_decode_cache(chip8_t *chip8, uint16_t addr, const uint16_t len) {
+  addr &= 0xFFF;  // writes wrap at the end of RAM, the wrapped part lands below the program region
+  chip8->writes++;
+  for (uint32_t a = (addr > ENTRY_POINT) ? addr - 1 : ENTRY_POINT; a < (uint32_t)addr + len && a < sizeof chip8->ram; a++) {
+    chip8->decode_cache[a - ENTRY_POINT].handler = NULL;
+  }
+  for (uint32_t a = (addr > ENTRY_POINT + MAX_BLOCK_LEN * 2) ? addr - MAX_BLOCK_LEN * 2 + 1 : ENTRY_POINT;
+       a < (uint32_t)addr + len && a < sizeof chip8->ram; a++) {
+    chip8->block_len[a - ENTRY_POINT] = 0;
+  }
+}
+
+#ifndef NO_SDL
+// final cleanup
+void final_cleanup(const sdl_t sdl) {
+  for (SDL_Texture *outlines : sdl.outlines) {
+    if (outlines) SDL_DestroyTexture(outlines);
+  }
+  SDL_DestroyTexture(sdl.screen);
+  SDL_DestroyRenderer(sdl.renderer);
+  SDL_DestroyWindow(sdl.window);
+  SDL_CloseAudioDevice(sdl.dev);
+  free(sdl.audio);
+  SDL_Quit();
+}
+
+// Init Screen Clear to background color
+// The machine's display/keypad are already cleared by init_chip8() (or restored by --load-state)
+void clear_screen(const sdl_t sdl, const config_t config) {
+  const uint8_t r = (config.bg_color >> 24) & 0xFF;
+  const uint8_t g = (config.bg_color >> 16) & 0xFF;
+  const uint8_t b = (config.bg_color >> 8) & 0xFF;
+  const uint8_t a = (config.bg_color >> 0) & 0xFF;
+
+  SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
+  SDL_RenderClear(sdl.renderer);
+}
+
+// Convert the dirty rows to RGBA8888, upload each run of them with one SDL_UpdateTexture
+// and scale the current resolution with one SDL_RenderCopy
+void update_screen(const sdl_t *sdl, const display_t *display, const uint64_t dirty, const config_t *config) {
+  // Плановите 0 и 1 се bg/fg боите, останатите XO-CHIP комбинации имаат фиксни бои
+  const uint32_t palette[16] = {config->bg_color, config->fg_color, 0xFF6600FF, 0x662200FF, 0xFF0000FF, 0x00FF00FF,
+                                0x0000FFFF,       0xFFFFFFFF,       0x808080FF, 0x00FFFFFF, 0xFF00FFFF, 0x800000FF,
+                                0x008000FF,       0x000080FF,       0x808000FF, 0xC0C0C0FF};
+  const uint32_t width = display_width(display), rows = display_rows(display);
+  uint32_t pixels[128 * DISPLAY_ROWS];
+
+  for (uint32_t y = 0; y < rows;) {
+    if (!((dirty >> y) & 1)) {
+      y++;
+      continue;
+    }
+    const uint32_t first = y;
+    for (; y < rows && ((dirty >> y) & 1); y++) {
+      for (uint32_t x = 0; x < width; x++) pixels[y * width + x] = palette[get_pixel(display, x, y)];
+    }
+    const SDL_Rect rect = {0, (int)first, (int)width, (int)(y - first)};
+    SDL_UpdateTexture(sdl->screen, &rect, &pixels[first * width], width * sizeof pixels[0]);
+  }
+  const SDL_Rect src = {0, 0, (int)width, (int)rows};
+  SDL_RenderCopy(sdl->renderer, sdl->screen, &src, NULL);
+
+  // Ако pixel_outline е true цртај ги пикселите поинаку
+  if (config->pixel_outlines && sdl->outlines[display->hires]) SDL_RenderCopy(sdl->renderer, sdl->outlines[display->hires], NULL, NULL);
+
+  SDL_RenderPresent(sdl->renderer);
+}
+#endif
+
+// Emulation thread: hand the finished display and the rows it changed to the SDL thread
+void publish_frame(frame_buffer_t *frames, const display_t *display, const uint64_t dirty) {
+  memcpy(&frames->display[frames->back], display, sizeof frames->display[0]);
+  frames->back = frames->latest.exchange(frames->back | FRESH_FRAME, std::memory_order_acq_rel) & ~FRESH_FRAME;
+  frames->dirty.fetch_or(dirty, std::memory_order_release);
+}
+
+// SDL thread: grab the newest published display into front, false if nothing new since last time
+bool take_frame(frame_buffer_t *frames) {
+  if (!(frames->latest.load(std::memory_order_relaxed) & FRESH_FRAME)) return false;
+  frames->front = frames->latest.exchange(frames->front, std::memory_order_acq_rel) & ~FRESH_FRAME;
+  return true;
+}
+
+bool push_input(input_ring_t *ring, const input_event_t event) {
+  const uint32_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) == INPUT_RING_SIZE) return false;  // full
+
+  ring->events[head % INPUT_RING_SIZE] = event;
+  ring->head.store(head + 1, std::memory_order_release);
+  { std::lock_guard<std::mutex> lock(ring->lock); }  // a consumer between its check and its wait gets the notify
+  ring->pushed.notify_one();
+  return true;
+}
+
+// Consumer: sleep until the ring has an event, or timeout_ms
+void wait_for_input(input_ring_t *ring, const uint32_t timeout_ms) {
+  std::unique_lock<std::mutex> lock(ring->lock);
+  ring->pushed.wait_for(lock, std::chrono::milliseconds(timeout_ms), [ring] {
+    return ring->tail.load(std::memory_order_relaxed) != ring->head.load(std::memory_order_acquire);
+  });
+}
+
+bool input_ring_full(input_ring_t *ring) {
+  return ring->head.load(std::memory_order_relaxed) - ring->tail.load(std::memory_order_acquire) == INPUT_RING_SIZE;
+}
+
+// Oldest event without consuming it
+bool peek_input(input_ring_t *ring, input_event_t *event) {
+  const uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  if (tail == ring->head.load(std::memory_order_acquire)) return false;  // empty
+
+  *event = ring->events[tail % INPUT_RING_SIZE];
+  return true;
+}
+
+bool pop_input(input_ring_t *ring, input_event_t *event) {
+  const uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  if (tail == ring->head.load(std::memory_order_acquire)) return false;  // empty
+
+  *event = ring->events[tail % INPUT_RING_SIZE];
+  ring->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+// Background thread: copy everything published so far to the file, sleep, repeat. After stop it does a last pass
+void trace_writer(tracer_t *tracer) {
+  for (;;) {
+    const bool stopping = tracer->stop.load(std::memory_order_acquire);
+    const uint32_t head = tracer->head.load(std::memory_order_acquire);
+    uint32_t tail = tracer->tail.load(std::memory_order_relaxed);
+
+    while (tail != head) {
+      // Up to the end of the ring, then the wrapped part on the next pass
+      const uint32_t start = tail % TRACE_RING_SIZE;
+      uint32_t n = head - tail;
+      if (n > TRACE_RING_SIZE - start) n = TRACE_RING_SIZE - start;
+      for (uint32_t i = 0; i < n; i++) {
+        const trace_record_t *record = &tracer->records[start + i];
+        uint8_t out[sizeof(trace_record_t)];
+        memcpy(out, record, TRACE_RECORD_HEADER);
+        uint8_t len = TRACE_RECORD_HEADER;
+        for (uint8_t x = 0; x < 16; x++) {
+          if (record->changed & (1 << x)) out[len++] = record->V[x];
+        }
+        fwrite(out, 1, len, tracer->file);
+      }
+      tail += n;
+      tracer->tail.store(tail, std::memory_order_release);
+    }
+    if (stopping) return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// Open tracer->path, write the header and start the writer thread
+bool start_trace(tracer_t *tracer) {
+  tracer->records = (trace_record_t *)malloc(TRACE_RING_SIZE * sizeof(trace_record_t));
+  tracer->file = fopen(tracer->path, "wb");
+  if (!tracer->records || !tracer->file) {
+    SDL_Log("Could not start trace %s\n", tracer->path);
+    if (tracer->file) fclose(tracer->file);
+    free(tracer->records);
+    tracer->records = NULL;
+    tracer->file = NULL;
+    return false;
+  }
+  setvbuf(tracer->file, NULL, _IOFBF, 1 << 20);
+
+  uint8_t header[8] = {'C', '8', 'T', 'R'};
+  put_le(put_le(&header[4], TRACE_VERSION, 2), TRACE_RECORD_HEADER, 2);
+  fwrite(header, 1, sizeof header, tracer->file);
+
+  tracer->head.store(0, std::memory_order_relaxed);
+  tracer->tail.store(0, std::memory_order_relaxed);
+  tracer->dropped = 0;
+  tracer->stop.store(false, std::memory_order_relaxed);
+  tracer->writer = std::thread(trace_writer, tracer);
+  SDL_Log("Tracing to %s\n", tracer->path);
+  return true;
+}
+
+// Flush what's left in the ring and close the file
+void stop_trace(tracer_t *tracer) {
+  tracer->stop.store(true, std::memory_order_release);
+  tracer->writer.join();
+  fclose(tracer->file);
+  free(tracer->records);
+  tracer->records = NULL;
+  tracer->file = NULL;
+  SDL_Log("Trace %s: %u records, %llu dropped\n", tracer->path, tracer->head.load(std::memory_order_relaxed),
+          (unsigned long long)tracer->dropped);
+}
+
+// Never waits on the writer, a full ring drops the record and counts it
+void push_trace(tracer_t *tracer, const trace_record_t record) {
+  const uint32_t head = tracer->head.load(std::memory_order_relaxed);
+  if (head - tracer->tail.load(std::memory_order_acquire) == TRACE_RING_SIZE) {
+    tracer->dropped++;
+    return;
+  }
+  tracer->records[head % TRACE_RING_SIZE] = record;
+  tracer->head.store(head + 1, std::memory_order_release);
+}
+
+// Record the instruction at pc that just executed, V_before = the registers before it
+void trace_instruction(chip8_t *chip8, const uint16_t pc, const uint8_t V_before[16]) {
+  trace_record_t record;
+  record.pc = pc;
+  record.opcode = chip8->inst.opcode;
+  record.I = chip8->I;
+  record.changed = 0;
+  for (uint8_t x = 0; x < 16; x++) record.changed |= (chip8->V[x] != V_before[x]) << x;
+  memcpy(record.V, chip8->V, sizeof record.V);
+  push_trace(chip8->trace, record);
+}
+
+// Mark a 60hz tick so the decoded trace lines up with frames
+void trace_frame(chip8_t *chip8) {
+  const trace_record_t record = {.pc = TRACE_FRAME, .opcode = (uint16_t)chip8->frames, .I = 0, .changed = 0, .V = {}};
+  push_trace(chip8->trace, record);
+}
+
+// Section timing, free when the profiler is off
+uint64_t profile_begin(const chip8_t *chip8) { return chip8->profile ? SDL_GetPerformanceCounter() : 0; }
+
+void profile_end(chip8_t *chip8, const profile_section_t section, const uint64_t start) {
+  if (!chip8->profile) return;
+  chip8->profile->ticks[section] += SDL_GetPerformanceCounter() - start;
+  chip8->profile->calls[section]++;
+}
+
+// RESET ROM, same random sequence and quirks as the first run, tracing carries on
+void reset_chip8(chip8_t *chip8) {
+  const uint32_t seed = chip8->seed;
+  const decoder_t decode = chip8->decode;
+  tracer_t *trace = chip8->trace;
+  profile_t *profile = chip8->profile;
+  init_chip8(chip8, chip8->rom);
+  seed_chip8(chip8, seed);
+  chip8->decode = decode;
+  chip8->trace = trace;
+  chip8->profile = profile;
+}
+
+// Apply user input to the machine, on whichever thread runs the emulation
+void apply_input(chip8_t *chip8, session_t *session, const input_event_t event) {
+  switch (event.type) {
+    case INPUT_NONE: break;
+    case INPUT_KEY_DOWN:
+      chip8->keypad[event.key] = true;
+      if (session->movie) record_movie(session->movie, chip8, MOVIE_KEY_DOWN, event.key);
+      break;
+    case INPUT_KEY_UP:
+      chip8->keypad[event.key] = false;
+      if (session->movie) record_movie(session->movie, chip8, MOVIE_KEY_UP, event.key);
+      break;
+    case INPUT_PAUSE:
+      if (chip8->state == RUNNING) {
+        chip8->state = PAUSED;
+        puts("==== PAUSED ====");
+      } else {
+        chip8->state = RUNNING;
+        puts("==== RESUME ====");
+      }
+      break;
+    case INPUT_RESET: {
+      const uint64_t cycles = chip8->cycles;
+      if (session->movie) record_movie(session->movie, chip8, MOVIE_RESET, 0);
+      reset_chip8(chip8);
+      if (session->movie) session->movie->frame_cycles -= cycles;  // cycles restart from 0 mid frame
       break;
     }
-    case 0x07: {
-      // 0x7XNN: Set register VX += NN
-      printf("Set register V%X (0x%02X) += NN (0x%02X). Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN,
-             chip8->V[chip8->inst.X] + chip8->inst.NN);
+    case INPUT_QUIT:
+      chip8->state = QUIT;  // EXIT EMULATOR LOOP
+      break;
+    case INPUT_SELECT_SLOT:
+      session->slot = event.key;
+      printf("==== SLOT %u ====\n", event.key + 1);
+      break;
+    case INPUT_SAVE_STATE:
+      save_state(chip8, session->slots[session->slot]);
+      session->used[session->slot] = true;
+      printf("==== SAVED SLOT %u ====\n", session->slot + 1);
+      break;
+    case INPUT_LOAD_STATE:
+      if (session->movie) {
+        puts("==== NO LOADING WHILE RECORDING ====");
+      } else if (session->used[session->slot] && load_state(chip8, session->slots[session->slot], SAVE_STATE_SIZE)) {
+        printf("==== LOADED SLOT %u ====\n", session->slot + 1);
+      }
+      break;
+    case INPUT_REWIND:
+      if (!session->movie) session->rewinding = event.key;
       break;
+    case INPUT_TRACE:
+      if (chip8->trace) {
+        stop_trace(chip8->trace);
+        chip8->trace = NULL;
+      } else if (start_trace(session->tracer)) {
+        chip8->trace = session->tracer;
+      }
+      break;
+    case INPUT_REDRAW: chip8->draw = true; break;
+  }
+}
+
+#ifndef NO_SDL
+// USER INPUT
+// CHIP8 Keypad QWERTY
+// 123C         1234
+// 456D		  	QWER
+// 789E		   	ASDF
+// A0BF         ZXCV
+const struct {
+  SDL_Scancode scancode;
+  input_type_t type;
+  uint8_t key;
+} default_keys[] = {
+    {SDL_SCANCODE_ESCAPE, INPUT_QUIT, 0},
+    {SDL_SCANCODE_SPACE, INPUT_PAUSE, 0},
+    {SDL_SCANCODE_TAB, INPUT_RESET, 0},  // RESET ROM
+
+    // SAVE STATES
+    {SDL_SCANCODE_F1, INPUT_SELECT_SLOT, 0},
+    {SDL_SCANCODE_F2, INPUT_SELECT_SLOT, 1},
+    {SDL_SCANCODE_F3, INPUT_SELECT_SLOT, 2},
+    {SDL_SCANCODE_F4, INPUT_SELECT_SLOT, 3},
+    {SDL_SCANCODE_F5, INPUT_SAVE_STATE, 0},
+    {SDL_SCANCODE_F9, INPUT_LOAD_STATE, 0},
+    {SDL_SCANCODE_F10, INPUT_TRACE, 0},
+
+    // REWIND while held
+    {SDL_SCANCODE_BACKSPACE, INPUT_REWIND, 0},
+
+    {SDL_SCANCODE_1, INPUT_KEY_DOWN, 0x1},
+    {SDL_SCANCODE_2, INPUT_KEY_DOWN, 0x2},
+    {SDL_SCANCODE_3, INPUT_KEY_DOWN, 0x3},
+    {SDL_SCANCODE_4, INPUT_KEY_DOWN, 0xC},
+
+    {SDL_SCANCODE_Q, INPUT_KEY_DOWN, 0x4},
+    {SDL_SCANCODE_W, INPUT_KEY_DOWN, 0x5},
+    {SDL_SCANCODE_E, INPUT_KEY_DOWN, 0x6},
+    {SDL_SCANCODE_R, INPUT_KEY_DOWN, 0xD},
+
+    {SDL_SCANCODE_A, INPUT_KEY_DOWN, 0x7},
+    {SDL_SCANCODE_S, INPUT_KEY_DOWN, 0x8},
+    {SDL_SCANCODE_D, INPUT_KEY_DOWN, 0x9},
+    {SDL_SCANCODE_F, INPUT_KEY_DOWN, 0xE},
+
+    {SDL_SCANCODE_Z, INPUT_KEY_DOWN, 0xA},
+    {SDL_SCANCODE_X, INPUT_KEY_DOWN, 0x0},
+    {SDL_SCANCODE_C, INPUT_KEY_DOWN, 0xB},
+    {SDL_SCANCODE_V, INPUT_KEY_DOWN, 0xF},
+};
+
+// Action names for keymap files, a single hex digit is a keypad key
+const struct {
+  const char *name;
+  input_type_t type;
+  uint8_t key;
+} key_actions[] = {
+    {"none", INPUT_NONE, 0},          {"quit", INPUT_QUIT, 0},          {"pause", INPUT_PAUSE, 0},
+    {"reset", INPUT_RESET, 0},        {"slot1", INPUT_SELECT_SLOT, 0},  {"slot2", INPUT_SELECT_SLOT, 1},
+    {"slot3", INPUT_SELECT_SLOT, 2},  {"slot4", INPUT_SELECT_SLOT, 3},  {"save", INPUT_SAVE_STATE, 0},
+    {"load", INPUT_LOAD_STATE, 0},    {"rewind", INPUT_REWIND, 0},      {"trace", INPUT_TRACE, 0},
+};
+
+// Trim spaces and tabs from both ends in place
+char *trim(char *text) {
+  while (*text == ' ' || *text == '\t') text++;
+  char *end = text + strlen(text);
+  while (end > text && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) end--;
+  *end = '\0';
+  return text;
+}
+
+// Default bindings, then the file's "<SDL key name> = <0-F|action>" lines over them; # starts a comment
+bool load_keymap(keymap_t *keymap, const char *path) {
+  memset(keymap, 0, sizeof *keymap);
+  for (const auto &binding : default_keys) {
+    keymap->keys[binding.scancode].type = binding.type;
+    keymap->keys[binding.scancode].key = binding.key;
+  }
+  if (!path) return true;
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    SDL_Log("Keymap file %s is invalid or does not exist\n", path);
+    return false;
+  }
+  char line[256];
+  for (uint32_t line_no = 1; fgets(line, sizeof line, file); line_no++) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char *equals = strchr(line, '=');
+    if (!equals) {
+      if (*trim(line)) {
+        SDL_Log("%s:%u: expected <key> = <action>\n", path, line_no);
+        fclose(file);
+        return false;
+      }
+      continue;
     }
-    case 0x08: {
-      switch (chip8->inst.N) {
-        case 0:
-          // 0x8XY0: Set register VX = VY
-          printf("Set register V%X = V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y]);
-          break;
-        case 1:
-          // 0x8XY1: Set register VX |= VY
-          printf("Set register V%X (0x%02X) |= V%X (0x%02X); Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-                 chip8->V[chip8->inst.X] | chip8->V[chip8->inst.Y]);
-          break;
-        case 2:
-          // 0x8XY2: Set register VX &= VY
-          printf("Set register V%X (0x%02X) &= V%X (0x%02X); Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-                 chip8->V[chip8->inst.X] & chip8->V[chip8->inst.Y]);
-          break;
-        case 3:
-          // 0x8XY3: Set register VX ^= VY
-          printf("Set register V%X (0x%02X) ^= V%X (0x%02X); Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-                 chip8->V[chip8->inst.X] ^ chip8->V[chip8->inst.Y]);
-          break;
-        case 4:
-          // 0x8XY4: Set register VX += VY, VF is set to 1 when there's an
-          // overflow
-          printf(
-              "Set register V%X (0x%02X) += V%X (0x%02X), VF = 1 if carry; "
-              "Result: 0x%02X, VF = %X\n",
-              chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y],
-              ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255));
-          break;
-          // If the addition results in a value greater than 255 (since CHIP-8
-          // uses 8-bit registers), an overflow occurs.
-        case 5:
-          // 0x8XY5: Set register VX -= VY, if there is not a borrow ( result is positive ) set VF to 1
-          printf("Set register V%X (0x%02X) -= V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n", chip8->inst.X, chip8->V[chip8->inst.X],
-                 chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y],
-                 (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]));
-          break;
-        case 6:
-          // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-          printf(
-              "Set register V%X (0x%02X) >>= 1, Result: 0x%02X, VF = %X "
-              "(shifted off bit)\n",
-              chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] & 1, chip8->V[chip8->inst.X] >> 1);
-          break;
-        case 7:  // TODO
-                 // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is
-                 // not a borrow ( result is positive )
-          printf(
-              "Set register V%X = V%X (0x%02X) - V%X (0x%02X), VF = 1 if no "
-              "borrow; Result: 0x%02X, VF = %X\n",
-              chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X],
-              (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
-          break;
-        case 0xE:  // TODO
-                   // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-          printf(
-              "Set register V%X (0x%02X) <<= 1, VF is the shifted off bit "
-              "(%X); Result: 0x%02X\n",
-              chip8->inst.X, chip8->V[chip8->inst.X], (chip8->V[chip8->inst.X] & 0x80) >> 7, chip8->V[chip8->inst.X] << 1);
-          break;
-        default: break;
+    *equals = '\0';
+    const char *name = trim(line), *action = trim(equals + 1);
+
+    const SDL_Scancode scancode = SDL_GetScancodeFromName(name);
+    if (scancode == SDL_SCANCODE_UNKNOWN) {
+      SDL_Log("%s:%u: unknown key %s\n", path, line_no, name);
+      fclose(file);
+      return false;
+    }
+    if (isxdigit((unsigned char)action[0]) && !action[1]) {
+      keymap->keys[scancode].type = INPUT_KEY_DOWN;
+      keymap->keys[scancode].key = (uint8_t)strtoul(action, NULL, 16);
+      continue;
+    }
+    bool found = false;
+    for (const auto &named : key_actions) {
+      if (strcmp(action, named.name) != 0) continue;
+      keymap->keys[scancode].type = named.type;
+      keymap->keys[scancode].key = named.key;
+      found = true;
+    }
+    if (!found) {
+      SDL_Log("%s:%u: unknown action %s, expected 0-F, none, quit, pause, reset, slot1-4, save, load, rewind or trace\n", path, line_no, action);
+      fclose(file);
+      return false;
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+// Queue the events through the keymap, stamped with when they happened. The machine is only touched by whoever
+// drains the ring. With wait_ms, sleep until the first event arrives or the time is up (paused, nothing to show).
+// Stops reading while the ring is full, the rest stays in SDL's queue. Returns false once quit has been requested
+bool handle_input(const sdl_t *sdl, input_ring_t *ring, const uint32_t wait_ms) {
+  SDL_Event event;
+  bool quit = false;
+
+  if (input_ring_full(ring)) return true;
+  for (bool pending = wait_ms ? SDL_WaitEventTimeout(&event, wait_ms) : SDL_PollEvent(&event); pending;
+       pending = !input_ring_full(ring) && SDL_PollEvent(&event)) {
+    input_event_t input = {.type = INPUT_NONE, .key = 0, .time = event.common.timestamp};
+    switch (event.type) {
+      case SDL_QUIT: input.type = INPUT_QUIT; break;  // EXIT EMULATOR LOOP
+      case SDL_KEYDOWN:
+        if (event.key.repeat) break;
+        input.type = sdl->keymap->keys[event.key.keysym.scancode].type;
+        input.key = sdl->keymap->keys[event.key.keysym.scancode].key;
+        if (input.type == INPUT_REWIND) input.key = 1;
+        if (input.type == INPUT_QUIT) puts("==== EXIT BUTTON ====");
+        break;
+      case SDL_KEYUP:
+        // Only held keys have a release
+        input.key = sdl->keymap->keys[event.key.keysym.scancode].key;
+        if (sdl->keymap->keys[event.key.keysym.scancode].type == INPUT_KEY_DOWN) input.type = INPUT_KEY_UP;
+        if (sdl->keymap->keys[event.key.keysym.scancode].type == INPUT_REWIND) {
+          input.type = INPUT_REWIND;
+          input.key = 0;
+        }
+        break;
+      case SDL_WINDOWEVENT:
+        if (event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) input.type = INPUT_REDRAW;
+        break;
+      default: break;
+    }
+    if (input.type == INPUT_NONE) continue;
+    push_input(ring, input);
+    quit |= input.type == INPUT_QUIT;
+  }
+  return !quit;
+}
+#endif
+
+// Text for one instruction, used by the trace decoder. Register values aren't known offline beyond what the
+// trace recorded, so the description only names operands
+void describe_instruction(const instruction_t inst, char *out, const size_t size) {
+  switch ((inst.opcode >> 12) & 0x0F) {
+    case 0x00:
+      if (inst.NN == 0xE0) {
+        // 0x00E0: Clear the screen
+        snprintf(out, size, "Clean screen");
+      } else if (inst.NN == 0xEE) {
+        // 0x00EE: Return from subroutine
+        snprintf(out, size, "Return from subroutine");
+      } else if (inst.NN == 0xFB) {
+        snprintf(out, size, "Scroll display right 4 pixels");
+      } else if (inst.NN == 0xFC) {
+        snprintf(out, size, "Scroll display left 4 pixels");
+      } else if (inst.NN == 0xFE) {
+        snprintf(out, size, "Low resolution 64x32");
+      } else if (inst.NN == 0xFF) {
+        snprintf(out, size, "High resolution 128x64");
+      } else if (inst.Y == 0xC) {
+        snprintf(out, size, "Scroll display down %u rows", inst.N);
+      } else if (inst.Y == 0xD) {
+        snprintf(out, size, "Scroll display up %u rows", inst.N);
+      } else {
+        snprintf(out, size, "Unimplemented Opcode.");
+      }
+      break;
+    case 0x01: snprintf(out, size, "Jump to address NNN (0x%04X)", inst.NNN); break;
+    case 0x02: snprintf(out, size, "Call subroutine at NNN (0x%04X)", inst.NNN); break;
+    case 0x03: snprintf(out, size, "Check if V%X == NN (0x%02X), skip next instruction if true.", inst.X, inst.NN); break;
+    case 0x04: snprintf(out, size, "Check if V%X != NN (0x%02X), skip next instruction if true.", inst.X, inst.NN); break;
+    case 0x05: snprintf(out, size, "Check if V%X == V%X, skip next instruction if true.", inst.X, inst.Y); break;
+    case 0x06: snprintf(out, size, "Set register V%X to NN (0x%02X)", inst.X, inst.NN); break;
+    case 0x07: snprintf(out, size, "Set register V%X += NN (0x%02X)", inst.X, inst.NN); break;
+    case 0x08:
+      switch (inst.N) {
+        case 0: snprintf(out, size, "Set register V%X = V%X", inst.X, inst.Y); break;
+        case 1: snprintf(out, size, "Set register V%X |= V%X", inst.X, inst.Y); break;
+        case 2: snprintf(out, size, "Set register V%X &= V%X", inst.X, inst.Y); break;
+        case 3: snprintf(out, size, "Set register V%X ^= V%X", inst.X, inst.Y); break;
+        case 4: snprintf(out, size, "Set register V%X += V%X, VF = 1 if carry", inst.X, inst.Y); break;
+        case 5: snprintf(out, size, "Set register V%X -= V%X, VF = 1 if no borrow", inst.X, inst.Y); break;
+        case 6: snprintf(out, size, "Set register V%X >>= 1, VF = shifted off bit", inst.X); break;
+        case 7: snprintf(out, size, "Set register V%X = V%X - V%X, VF = 1 if no borrow", inst.X, inst.Y, inst.X); break;
+        case 0xE: snprintf(out, size, "Set register V%X <<= 1, VF = shifted off bit", inst.X); break;
+        default: snprintf(out, size, "Unimplemented Opcode."); break;
+      }
+      break;
+    case 0x09: snprintf(out, size, "Check if V%X != V%X, skip next instruction if true.", inst.X, inst.Y); break;
+    case 0x0A: snprintf(out, size, "SET index register I to NNN (0x%04X)", inst.NNN); break;
+    case 0x0B: snprintf(out, size, "Set PC to V0 + NNN (0x%04X)", inst.NNN); break;
+    case 0x0C: snprintf(out, size, "Set V%X = rand() %% 256 & NN (0x%02X)", inst.X, inst.NN); break;
+    case 0x0D:
+      snprintf(out, size, "Draw N (%u) height sprite at coords V%X, V%X from memory location I. Set VF = 1 if any pixels are turned off.", inst.N,
+               inst.X, inst.Y);
+      break;
+    case 0x0E:
+      if (inst.NN == 0x9E) {
+        snprintf(out, size, "Skip next instruction if key in V%X is pressed", inst.X);
+      } else if (inst.NN == 0xA1) {
+        snprintf(out, size, "Skip next instruction if key in V%X is not pressed", inst.X);
+      } else {
+        snprintf(out, size, "Unimplemented Opcode.");
+      }
+      break;
+    case 0x0F:
+      switch (inst.NN) {
+        case 0x0A: snprintf(out, size, "Await until a key is pressed; Store key in V%X", inst.X); break;
+        case 0x1E: snprintf(out, size, "I += V%X", inst.X); break;
+        case 0x07: snprintf(out, size, "Set V%X = delay timer value", inst.X); break;
+        case 0x15: snprintf(out, size, "Set delay timer value = V%X", inst.X); break;
+        case 0x18: snprintf(out, size, "Set sound timer value = V%X", inst.X); break;
+        case 0x29: snprintf(out, size, "Set I to sprite location in memory for character V%X", inst.X); break;
+        case 0x33: snprintf(out, size, "Store BCD representation of V%X at memory from I", inst.X); break;
+        case 0x55: snprintf(out, size, "Register dump V0-V%X inclusive at memory from I", inst.X); break;
+        case 0x65: snprintf(out, size, "Register load V0-V%X inclusive from memory from I", inst.X); break;
+        case 0x02: snprintf(out, size, "Load 16 byte audio pattern from memory at I"); break;
+        case 0x3A: snprintf(out, size, "Set audio pattern pitch = V%X", inst.X); break;
+        case 0x01: snprintf(out, size, "Select display planes %X", inst.X); break;
+        case 0x30: snprintf(out, size, "Set I to big sprite location in memory for character V%X", inst.X); break;
+        default: snprintf(out, size, "Unimplemented Opcode."); break;
+      }
+      break;
+  }
+}
+
+// Opcode handlers; the current instruction is already decoded into chip8->inst and PC points past it
+// A call past the 12 stack slots or a return with none: the machine stops on the faulting instruction.
+// The rest of the slice runs it again without effect, so every engine stops in the same state
+void stack_fault(chip8_t *chip8, const char *fault) {
+  chip8->PC -= 2;
+#ifndef FUZZ  // most random ROMs fault, a line per input would bury real findings
+  if (chip8->state != QUIT) SDL_Log("Stack %s at 0x%03X, machine stopped\n", fault, chip8->PC);
+#else
+  (void)fault;
+#endif
+  chip8->state = QUIT;
+}
+
+// At a backward jump (or FX0A still waiting) at address at: compare with the machine as it was the last time
+// round. Unchanged = the loop spins until the slice ends, idle_period is the length of one round
+void check_idle(chip8_t *chip8, const uint16_t at) {
+  idle_state_t state;
+  memset(&state, 0, sizeof state);  // padding too, it is compared with memcmp
+  memcpy(state.V, chip8->V, sizeof state.V);
+  memcpy(state.stack, chip8->stack, sizeof state.stack);
+  state.I = chip8->I;
+  state.sp = chip8->stack_ptr - chip8->stack;
+  state.delay_timer = chip8->delay_timer;
+  state.rng = chip8->rng;
+  state.writes = chip8->writes;
+
+  if (chip8->idle_pc == at && memcmp(&state, &chip8->idle_state, sizeof state) == 0) {
+    chip8->idle_period = chip8->cycles - chip8->idle_cycles;
+    return;
+  }
+  chip8->idle_pc = at;
+  chip8->idle_state = state;
+  chip8->idle_cycles = chip8->cycles;
+}
+
+void op_nop(chip8_t *chip8, const config_t *config) {
+  // Unimplemented/invalid opcode, may be 0xNNN for calling machine code routine RCA1802
+  (void)chip8;
+  (void)config;
+}
+
+void op_00E0(chip8_t *chip8, const config_t *config) {
+  // 0x00E0: Clear the selected planes
+  (void)config;
+  for (uint8_t p = 0; p < DISPLAY_PLANES; p++) {
+    if (chip8->plane_mask & (1 << p)) memset(chip8->display.planes[p], 0, sizeof chip8->display.planes[p]);
+  }
+  chip8->dirty = ~0ULL;
+  chip8->draw = true;
+  chip8->writes++;
+}
+
+void op_00CN(chip8_t *chip8, const config_t *config) {
+  // 0x00CN: SCHIP, scroll the selected planes down N rows
+  (void)config;
+  const uint8_t rows = display_rows(&chip8->display), n = chip8->inst.N;
+  for (uint8_t p = 0; p < DISPLAY_PLANES; p++) {
+    if (!(chip8->plane_mask & (1 << p))) continue;
+    uint64_t(*plane)[ROW_WORDS] = chip8->display.planes[p];
+    memmove(plane[n], plane[0], (rows - n) * sizeof plane[0]);
+    memset(plane[0], 0, n * sizeof plane[0]);
+  }
+  chip8->dirty = ~0ULL;
+  chip8->draw = true;
+  chip8->writes++;
+}
+
+void op_00DN(chip8_t *chip8, const config_t *config) {
+  // 0x00DN: XO-CHIP, scroll the selected planes up N rows
+  (void)config;
+  const uint8_t rows = display_rows(&chip8->display), n = chip8->inst.N;
+  for (uint8_t p = 0; p < DISPLAY_PLANES; p++) {
+    if (!(chip8->plane_mask & (1 << p))) continue;
+    uint64_t(*plane)[ROW_WORDS] = chip8->display.planes[p];
+    memmove(plane[0], plane[n], (rows - n) * sizeof plane[0]);
+    memset(plane[rows - n], 0, n * sizeof plane[0]);
+  }
+  chip8->dirty = ~0ULL;
+  chip8->draw = true;
+  chip8->writes++;
+}
+
+void op_00FB(chip8_t *chip8, const config_t *config) {
+  // 0x00FB: SCHIP, scroll the selected planes right 4 pixels
+  (void)config;
+  const uint8_t rows = display_rows(&chip8->display);
+  for (uint8_t p = 0; p < DISPLAY_PLANES; p++) {
+    if (!(chip8->plane_mask & (1 << p))) continue;
+    for (uint8_t y = 0; y < rows; y++) {
+      uint64_t *row = chip8->display.planes[p][y];
+      // Во lores вториот збор мора да остане празен
+      if (chip8->display.hires) row[1] = (row[1] >> 4) | (row[0] << 60);
+      row[0] >>= 4;
+    }
+  }
+  chip8->dirty = ~0ULL;
+  chip8->draw = true;
+  chip8->writes++;
+}
+
+void op_00FC(chip8_t *chip8, const config_t *config) {
+  // 0x00FC: SCHIP, scroll the selected planes left 4 pixels
+  (void)config;
+  const uint8_t rows = display_rows(&chip8->display);
+  for (uint8_t p = 0; p < DISPLAY_PLANES; p++) {
+    if (!(chip8->plane_mask & (1 << p))) continue;
+    for (uint8_t y = 0; y < rows; y++) {
+      uint64_t *row = chip8->display.planes[p][y];
+      row[0] = (row[0] << 4) | (row[1] >> 60);
+      row[1] <<= 4;
+    }
+  }
+  chip8->dirty = ~0ULL;
+  chip8->draw = true;
+  chip8->writes++;
+}
+
+void op_00FE(chip8_t *chip8, const config_t *config) {
+  // 0x00FE: SCHIP, 64x32 low resolution; clears the display like XO-CHIP
+  (void)config;
+  memset(&chip8->display, 0, sizeof chip8->display);
+  chip8->dirty = ~0ULL;
+  chip8->draw = true;
+  chip8->writes++;
+}
+
+void op_00FF(chip8_t *chip8, const config_t *config) {
+  // 0x00FF: SCHIP, 128x64 high resolution; clears the display like XO-CHIP
+  (void)config;
+  memset(&chip8->display, 0, sizeof chip8->display);
+  chip8->display.hires = true;
+  chip8->dirty = ~0ULL;
+  chip8->draw = true;
+  chip8->writes++;
+}
+
+void op_00EE(chip8_t *chip8, const config_t *config) {
+  // 0x00EE: Return from subroutine
+  // Set program counter to last address on subroutine stack so that
+  // next opcode will be gotten from that address
+  (void)config;
+  if (chip8->stack_ptr == chip8->stack) {
+    stack_fault(chip8, "underflow");
+    return;
+  }
+  chip8->PC = *--chip8->stack_ptr;
+}
+
+void op_1NNN(chip8_t *chip8, const config_t *config) {
+  // 0x1NNN: Jump to address NNN
+  (void)config;
+  if (chip8->inst.NNN < chip8->PC) check_idle(chip8, chip8->PC - 2);  // loops go back, a spin is a loop
+  chip8->PC = chip8->inst.NNN;  // Set PC so that next opcode is from NNN.
+}
+
+void op_2NNN(chip8_t *chip8, const config_t *config) {
+  // 0x2NNN: Call subroutine at NNN
+  (void)config;
+  if (chip8->stack_ptr == chip8->stack + 12) {
+    stack_fault(chip8, "overflow");
+    return;
+  }
+  *chip8->stack_ptr++ = chip8->PC;  // Store current address to return to on subroutine stack
+  chip8->PC = chip8->inst.NNN;      // set PC to subroutine address so that
+                                    // the next opcode is gotten from there.
+}
+
+void op_3XNN(chip8_t *chip8, const config_t *config) {
+  // 0x3XNN: Skips the next instruction if VX equals NN (usually the next
+  // instruction is a jump to skip a code block)
+  (void)config;
+  if (chip8->V[chip8->inst.X] == chip8->inst.NN) chip8->PC += 2;
+}
+
+void op_4XNN(chip8_t *chip8, const config_t *config) {
+  // 0x4XNN: Skips the next instruction if VX doesn't equal NN (usually
+  // the next instruction is a jump to skip a code block)
+  (void)config;
+  if (chip8->V[chip8->inst.X] != chip8->inst.NN) chip8->PC += 2;
+}
+
+void op_5XY0(chip8_t *chip8, const config_t *config) {
+  // 0x5XY0: Skips the next instruction if VX equals VY (usually the next
+  // instruction is a jump to skip a code block)
+  (void)config;
+  if (chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) chip8->PC += 2;
+}
+
+void op_6XNN(chip8_t *chip8, const config_t *config) {
+  // 0x6XNN: Set register VX to NN
+  (void)config;
+  chip8->V[chip8->inst.X] = chip8->inst.NN;
+}
+
+void op_7XNN(chip8_t *chip8, const config_t *config) {
+  // 0x7XNN: Set register VX += NN
+  (void)config;
+  chip8->V[chip8->inst.X] += chip8->inst.NN;
+}
+
+void op_8XY0(chip8_t *chip8, const config_t *config) {
+  // 0x8XY0: Set register VX = VY
+  (void)config;
+  chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+}
+
+void op_8XY1(chip8_t *chip8, const config_t *config) {
+  // 0x8XY1: Set register VX |= VY
+  (void)config;
+  chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+}
+
+void op_8XY2(chip8_t *chip8, const config_t *config) {
+  // 0x8XY2: Set register VX &= VY
+  (void)config;
+  chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+}
+
+void op_8XY3(chip8_t *chip8, const config_t *config) {
+  // 0x8XY3: Set register VX ^= VY
+  (void)config;
+  chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+}
+
+void op_8XY4(chip8_t *chip8, const config_t *config) {
+  // 0x8XY4: Set register VX += VY, VF is set to 1 when there's an
+  // overflow If the addition results in a value greater than 255
+  // (since CHIP-8 uses 8-bit registers), an overflow occurs.
+  (void)config;
+  if ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255) chip8->V[0xF] = 1;
+  chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+}
+
+void op_8XY5(chip8_t *chip8, const config_t *config) {
+  // 0x8XY5: Set register VX -= VY, if there is not a borrow ( result is positive ) set VF to 1
+  (void)config;
+  chip8->V[0xF] = (chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]);
+  chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
+}
+
+template <bool shift>
+void op_8XY6(chip8_t *chip8, const config_t *config) {
+  // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
+  // COSMAC shifts VY into VX
+  (void)config;
+  const uint8_t value = chip8->V[shift ? chip8->inst.X : chip8->inst.Y];
+  chip8->V[chip8->inst.X] = value >> 1;
+  chip8->V[0xF] = value & 0x01;
+}
+
+void op_8XY7(chip8_t *chip8, const config_t *config) {
+  // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow ( result is positive )
+  (void)config;
+  chip8->V[0xF] = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]);
+  chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
+}
+
+template <bool shift>
+void op_8XYE(chip8_t *chip8, const config_t *config) {
+  // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
+  // COSMAC shifts VY into VX
+  (void)config;
+  const uint8_t value = chip8->V[shift ? chip8->inst.X : chip8->inst.Y];
+  chip8->V[chip8->inst.X] = value << 1;
+  chip8->V[0xF] = (value & 0x80) >> 7;
+}
+
+void op_9XY0(chip8_t *chip8, const config_t *config) {
+  // 0x9XY0: If VX != VY, skip next instruction
+  (void)config;
+  if (chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y]) chip8->PC += 2;
+}
+
+void op_ANNN(chip8_t *chip8, const config_t *config) {
+  // 0xANNN: SET index register I to NNN
+  (void)config;
+  chip8->I = chip8->inst.NNN;
+}
+
+template <bool jump>
+void op_BNNN(chip8_t *chip8, const config_t *config) {
+  // 0xBNNN: Jump to the address NNN + V0
+  // SCHIP jumps to XNN + VX
+  (void)config;
+  chip8->PC = chip8->V[jump ? chip8->inst.X : 0] + chip8->inst.NNN;
+}
+
+void op_CXNN(chip8_t *chip8, const config_t *config) {
+  // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
+  (void)config;
+  uint32_t x = chip8->rng;  // xorshift32
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  chip8->rng = x;
+  chip8->V[chip8->inst.X] = (x >> 24) & chip8->inst.NN;
+}
+
+template <bool clip>
+void op_DXYN(chip8_t *chip8, const config_t *config) {
+  // 0xDXYN: Draw N-height sprite at coords X,Y; Read from mem location I;
+  // Screen pixels are XOR'd with sprite bits,
+  // VF carry flag is set any screen pixles are set off; This is useful
+  // for collision detection or other reasons
+  // SCHIP: N=0 draws a 16x16 sprite; XO-CHIP: each selected plane takes the next sprite from I
+  (void)config;
+  const bool hires = chip8->display.hires;
+  const uint8_t X_coord = chip8->V[chip8->inst.X] % display_width(&chip8->display);
+  const uint8_t Y_coord = chip8->V[chip8->inst.Y] % display_rows(&chip8->display);
+  const uint8_t height = chip8->inst.N ? chip8->inst.N : 16, bytes = chip8->inst.N ? 1 : 2;
+
+  // Престани да црташ ако стигнеш до долниот крај на екранот, освен ако ROM-от бара wrap
+  const uint8_t rows = display_rows(&chip8->display);
+  const uint8_t drawn = !clip || height < rows - Y_coord ? height : rows - Y_coord;
+  uint16_t addr = chip8->I;
+
+  chip8->V[0xF] = 0;  // Иницијализација на carry flag
+
+  for (uint8_t p = 0; p < DISPLAY_PLANES; p++) {
+    if (!(chip8->plane_mask & (1 << p))) continue;
+
+    // One or two shifts + XOR per sprite row
+    for (uint8_t i = 0; i < drawn; i++) {
+      const uint16_t at = addr + i * bytes;
+      const uint64_t bits = bytes == 2 ? (chip8->ram[at & 0xFFF] << 8) | chip8->ram[(at + 1) & 0xFFF] : chip8->ram[at & 0xFFF];
+
+      // Sprite row moved to the left edge of the row, then right to X across both words; bits past the right edge fall off (clipping)
+      // or come back in at the left edge (wrap)
+      const uint64_t sprite_row = bits << (64 - 8 * bytes);
+      uint64_t left = X_coord < 64 ? sprite_row >> X_coord : 0;
+      const uint64_t right = !hires || X_coord == 0 ? 0 : X_coord < 64 ? sprite_row << (64 - X_coord) : sprite_row >> (X_coord - 64);
+      if (!clip) {
+        if (!hires && X_coord) left |= sprite_row << (64 - X_coord);
+        else if (hires && X_coord > 64) left |= sprite_row << (128 - X_coord);
+      }
+
+      // Доколку sprite pixel/bit е вклучен и display pixel е вклучен, пушти carry flag
+      const uint8_t y = (Y_coord + i) % rows;
+      uint64_t *row = chip8->display.planes[p][y];
+      chip8->V[0xF] |= ((row[0] & left) | (row[1] & right)) != 0;
+      row[0] ^= left;
+      row[1] ^= right;
+    }
+    addr += height * bytes;
+  }
+  if (clip) chip8->dirty |= (drawn >= 64 ? ~0ULL : (1ULL << drawn) - 1) << Y_coord;
+  else for (uint8_t i = 0; i < drawn; i++) chip8->dirty |= 1ULL << ((Y_coord + i) % rows);
+  chip8->draw = true;
+  chip8->writes++;
+}
+
+void op_EX9E(chip8_t *chip8, const config_t *config) {
+  // 0xEX9E: Skip next instruction if key in VX is pressed
+  (void)config;
+  if (chip8->keypad[chip8->V[chip8->inst.X] & 0x0F]) chip8->PC += 2;
+}
+
+void op_EXA1(chip8_t *chip8, const config_t *config) {
+  // 0xEXA1: Skip next instruction if key in VX is not pressed
+  (void)config;
+  if (!chip8->keypad[chip8->V[chip8->inst.X] & 0x0F]) chip8->PC += 2;
+}
+
+void op_FX07(chip8_t *chip8, const config_t *config) {
+  // 0xFX07: VX = delay timer
+  (void)config;
+  chip8->V[chip8->inst.X] = chip8->delay_timer;
+}
+
+void op_FX0A(chip8_t *chip8, const config_t *config) {
+  // 0xFX0A: VX = get_key() Чекај додека не е стиснато копче, и внеси го во VX
+  (void)config;
+  for (uint8_t i = 0; i < sizeof chip8->keypad; i++) {
+    if (chip8->keypad[i]) {
+      chip8->V[chip8->inst.X] = i;  // the key, not its state
+      return;
+    }
+  }
+  chip8->PC -= 2;
+  check_idle(chip8, chip8->PC);  // no key can arrive before the slice ends
+}
+
+void op_FX15(chip8_t *chip8, const config_t *config) {
+  // 0xFX15: delay timer = VX
+  (void)config;
+  chip8->delay_timer = chip8->V[chip8->inst.X];
+}
+
+void op_FX18(chip8_t *chip8, const config_t *config) {
+  // 0xFX18: sound timer = VX
+  (void)config;
+  chip8->sound_timer = chip8->V[chip8->inst.X];
+}
+
+void op_FX1E(chip8_t *chip8, const config_t *config) {
+  // 0xFX1E: I += VX; Add VX to register I. For non-Amiga CHIP8, does not affect VF.
+  (void)config;
+  chip8->I += chip8->V[chip8->inst.X];
+}
+
+void op_FX29(chip8_t *chip8, const config_t *config) {
+  // 0xFX29 Set register I to sprite location in memory for character in VX (0x0-0xF)
+  (void)config;
+  chip8->I = chip8->V[chip8->inst.X] * 5;
+}
+
+void op_FX33(chip8_t *chip8, const config_t *config) {
+  // 0xFX33 Store BCD representation of VX at memory offset from I
+  // I = hundred's place, I+1 = ten's place, I+2 one's place
+  (void)config;
+  uint8_t bcd = chip8->V[chip8->inst.X];
+  chip8->ram[(chip8->I + 2) & 0xFFF] = bcd % 10;
+  bcd /= 10;
+  chip8->ram[(chip8->I + 1) & 0xFFF] = bcd % 10;
+  bcd /= 10;
+  chip8->ram[chip8->I & 0xFFF] = bcd;
+  invalidate_decode_cache(chip8, chip8->I, 3);
+}
+
+template <bool load_store>
+void op_FX55(chip8_t *chip8, const config_t *config) {
+  // 0xFX55 Register dump V0-VX inclusive to memory offset from I
+  // SCHIP does not increment I, Chip-8 does (load_store)
+  (void)config;
+  for (uint8_t i = 0; i <= chip8->inst.X; i++) {
+    chip8->ram[(chip8->I + i) & 0xFFF] = chip8->V[i];
+  }
+  invalidate_decode_cache(chip8, chip8->I, chip8->inst.X + 1);
+  if (!load_store) chip8->I += chip8->inst.X + 1;
+}
+
+void op_F002(chip8_t *chip8, const config_t *config) {
+  // 0xF002: XO-CHIP, load the 16 byte audio pattern from memory at I
+  (void)config;
+  for (uint8_t i = 0; i < sizeof chip8->audio_pattern; i++) chip8->audio_pattern[i] = chip8->ram[(chip8->I + i) & 0xFFF];
+  chip8->pattern_loaded = true;
+}
+
+void op_FN01(chip8_t *chip8, const config_t *config) {
+  // 0xFN01: XO-CHIP, select the bit planes N used by draw, clear and scroll
+  (void)config;
+  chip8->plane_mask = chip8->inst.X;
+}
+
+void op_FX30(chip8_t *chip8, const config_t *config) {
+  // 0xFX30: SCHIP, set register I to the 8x10 sprite for character in VX (0x0-0xF)
+  (void)config;
+  chip8->I = BIG_FONT + (chip8->V[chip8->inst.X] & 0x0F) * 10;
+}
+
+void op_FX3A(chip8_t *chip8, const config_t *config) {
+  // 0xFX3A: XO-CHIP, audio pattern pitch = VX
+  (void)config;
+  chip8->pitch = chip8->V[chip8->inst.X];
+}
+
+template <bool load_store>
+void op_FX65(chip8_t *chip8, const config_t *config) {
+  // 0xFX65 Register load V0-VX inclusive from memory offset from I
+  // SCHIP does not increment I, Chip-8 does (load_store)
+  (void)config;
+  for (uint8_t i = 0; i <= chip8->inst.X; i++) {
+    chip8->V[i] = chip8->ram[(chip8->I + i) & 0xFFF];
+  }
+  if (!load_store) chip8->I += chip8->inst.X + 1;
+}
+
+// Split an opcode into its operands and pick the handler that emulates it, as instantiated for the quirk profile
+template <uint8_t profile = DEFAULT_QUIRK_PROFILE>
+decoded_inst_t decode_instruction(const uint16_t opcode) {
+  constexpr bool shift = profile & QUIRK_SHIFT, load_store = profile & QUIRK_LOAD_STORE;
+  constexpr bool jump = profile & QUIRK_JUMP, clip = profile & QUIRK_CLIP;
+  decoded_inst_t decoded = {
+      .handler = op_nop,
+      .inst =
+          {
+              .opcode = opcode,
+              .NNN = (uint16_t)(opcode & 0x0FFF),
+              .NN = (uint8_t)(opcode & 0x0FF),
+              .N = (uint8_t)(opcode & 0x0F),
+              .X = (uint8_t)((opcode >> 8) & 0x0F),
+              .Y = (uint8_t)((opcode >> 4) & 0x0F),
+          },
+  };
+
+  switch ((opcode >> 12) & 0x0F) {
+    case 0x00:
+      if (decoded.inst.NN == 0xE0) {
+        decoded.handler = op_00E0;
+      } else if (decoded.inst.NN == 0xEE) {
+        decoded.handler = op_00EE;
+      } else if (decoded.inst.X == 0) {
+        switch (decoded.inst.NN) {
+          case 0xFB: decoded.handler = op_00FB; break;
+          case 0xFC: decoded.handler = op_00FC; break;
+          case 0xFE: decoded.handler = op_00FE; break;
+          case 0xFF: decoded.handler = op_00FF; break;
+          default:
+            if (decoded.inst.Y == 0xC) decoded.handler = op_00CN;
+            if (decoded.inst.Y == 0xD) decoded.handler = op_00DN;
+            break;
+        }
+      }
+      break;
+    case 0x01: decoded.handler = op_1NNN; break;
+    case 0x02: decoded.handler = op_2NNN; break;
+    case 0x03: decoded.handler = op_3XNN; break;
+    case 0x04: decoded.handler = op_4XNN; break;
+    case 0x05:
+      if (decoded.inst.N == 0) decoded.handler = op_5XY0;
+      break;
+    case 0x06: decoded.handler = op_6XNN; break;
+    case 0x07: decoded.handler = op_7XNN; break;
+    case 0x08:
+      switch (decoded.inst.N) {
+        case 0: decoded.handler = op_8XY0; break;
+        case 1: decoded.handler = op_8XY1; break;
+        case 2: decoded.handler = op_8XY2; break;
+        case 3: decoded.handler = op_8XY3; break;
+        case 4: decoded.handler = op_8XY4; break;
+        case 5: decoded.handler = op_8XY5; break;
+        case 6: decoded.handler = op_8XY6<shift>; break;
+        case 7: decoded.handler = op_8XY7; break;
+        case 0xE: decoded.handler = op_8XYE<shift>; break;
+        default: break;
+      }
+      break;
+    case 0x09: decoded.handler = op_9XY0; break;
+    case 0x0A: decoded.handler = op_ANNN; break;
+    case 0x0B: decoded.handler = op_BNNN<jump>; break;
+    case 0x0C: decoded.handler = op_CXNN; break;
+    case 0x0D: decoded.handler = op_DXYN<clip>; break;
+    case 0x0E:
+      if (decoded.inst.NN == 0x9E) {
+        decoded.handler = op_EX9E;
+      } else if (decoded.inst.NN == 0xA1) {
+        decoded.handler = op_EXA1;
+      }
+      break;
+    case 0x0F:
+      switch (decoded.inst.NN) {
+        case 0x01: decoded.handler = op_FN01; break;
+        case 0x02:
+          if (decoded.inst.X == 0) decoded.handler = op_F002;
+          break;
+        case 0x07: decoded.handler = op_FX07; break;
+        case 0x0A: decoded.handler = op_FX0A; break;
+        case 0x15: decoded.handler = op_FX15; break;
+        case 0x18: decoded.handler = op_FX18; break;
+        case 0x1E: decoded.handler = op_FX1E; break;
+        case 0x29: decoded.handler = op_FX29; break;
+        case 0x30: decoded.handler = op_FX30; break;
+        case 0x33: decoded.handler = op_FX33; break;
+        case 0x3A: decoded.handler = op_FX3A; break;
+        case 0x55: decoded.handler = op_FX55<load_store>; break;
+        case 0x65: decoded.handler = op_FX65<load_store>; break;
+        default: break;
+      }
+      break;
+    default: break;
+  }
+  return decoded;
+}
+
+const decoder_t decoders[QUIRK_PROFILES] = {
+    decode_instruction<0>,  decode_instruction<1>,  decode_instruction<2>,  decode_instruction<3>,
+    decode_instruction<4>,  decode_instruction<5>,  decode_instruction<6>,  decode_instruction<7>,
+    decode_instruction<8>,  decode_instruction<9>,  decode_instruction<10>, decode_instruction<11>,
+    decode_instruction<12>, decode_instruction<13>, decode_instruction<14>, decode_instruction<15>,
+};
+
+decoder_t quirk_decoder(const quirks_t quirks) {
+  return decoders[(quirks.shift ? QUIRK_SHIFT : 0) | (quirks.load_store ? QUIRK_LOAD_STORE : 0) | (quirks.jump ? QUIRK_JUMP : 0) |
+                  (quirks.clip ? QUIRK_CLIP : 0)];
+}
+
+// The instruction at PC, decoded with the machine's quirk profile. PC past the end of RAM (a skip at 0xFFE,
+// BNNN) reads wrapped around, as RAM writes do
+decoded_inst_t fetch_instruction(chip8_t *chip8, const emu_engine_t engine) {
+  const uint16_t pc = chip8->PC & 0xFFF;
+
+  if (engine != INTERPRETER && pc >= ENTRY_POINT && pc < sizeof chip8->ram - 1) {
+    // Decode once per address, reuse until a RAM write invalidates the slot
+    decoded_inst_t *slot = &chip8->decode_cache[pc - ENTRY_POINT];
+    if (!slot->handler) *slot = chip8->decode((chip8->ram[pc] << 8) | chip8->ram[pc + 1]);
+    return *slot;
+  }
+  return chip8->decode((chip8->ram[pc] << 8) | chip8->ram[(pc + 1) & 0xFFF]);  // следен operation code од рам
+}
+
+template <bool traced, bool profiled>
+void emulate_instruction(chip8_t *chip8, const config_t config) {
+  const uint16_t pc = chip8->PC;
+  const decoded_inst_t decoded = fetch_instruction(chip8, config.engine);
+
+  chip8->inst = decoded.inst;
+  chip8->PC += 2;  // инкрементирање на Program Counter за 2 бајти затоа што 1
+                   // опкод е 16 бита
+  chip8->cycles++;
+
+  if (profiled) {
+    chip8->profile->opcodes[decoded.inst.opcode]++;
+    chip8->profile->pcs[pc & 0xFFF]++;
+  }
+
+  // Emulate opcode
+  uint8_t V_before[16];
+  if (traced) memcpy(V_before, chip8->V, sizeof V_before);
+  decoded.handler(chip8, &config);
+  if (traced) trace_instruction(chip8, pc, V_before);
+}
+
+// Does this handler end a basic block? Jumps, calls, returns and skips change PC,
+// FX0A rewinds it, and FX33/FX55 write RAM and may have modified the code that follows.
+bool ends_block(const opcode_handler_t handler) {
+  return handler == op_00EE || handler == op_1NNN || handler == op_2NNN || handler == op_BNNN<false> || handler == op_BNNN<true> ||
+         handler == op_3XNN || handler == op_4XNN || handler == op_5XY0 || handler == op_9XY0 || handler == op_EX9E || handler == op_EXA1 ||
+         handler == op_FX0A || handler == op_FX33 || handler == op_FX55<false> || handler == op_FX55<true>;
+}
+
+// Predecode the straight-line run of instructions starting at pc, returns its length in instructions
+uint8_t translate_block(chip8_t *chip8, const uint16_t pc) {
+  uint8_t len = 0;
+
+  for (uint32_t a = pc; len < MAX_BLOCK_LEN && a < sizeof chip8->ram - 1; a += 2) {
+    decoded_inst_t *slot = &chip8->decode_cache[a - ENTRY_POINT];
+    if (!slot->handler) *slot = chip8->decode((chip8->ram[a] << 8) | chip8->ram[a + 1]);
+    len++;
+    if (ends_block(slot->handler)) break;
+  }
+  return len;
+}
+
+// Emulate count instructions with the configured engine, traced/profiled build the hooks in at compile time
+// The machine spins: skip whole rounds of the loop, they would leave it exactly as it is. Returns the count left
+// to run, less than a round, so the slice still ends at the same point in the loop
+uint32_t skip_idle(chip8_t *chip8, const uint32_t count) {
+  const uint32_t skipped = count - count % chip8->idle_period;
+  chip8->cycles += skipped;
+  chip8->idle_period = 0;
+  return count - skipped;
+}
+
+template <bool traced, bool profiled>
+void execute_instructions(chip8_t *chip8, const config_t config, uint32_t count) {
+  if (config.engine != THREADED) {
+    while (count--) {
+      emulate_instruction<traced, profiled>(chip8, config);
+      if (!traced && !profiled && chip8->idle_period) count = skip_idle(chip8, count);
+    }
+    return;
+  }
+
+  while (count) {
+    const uint16_t pc = chip8->PC;
+    if (pc < ENTRY_POINT || pc >= sizeof chip8->ram - 1) {
+      // Outside the program region, nothing to translate
+      emulate_instruction<traced, profiled>(chip8, config);
+      count--;
+      if (!traced && !profiled && chip8->idle_period) count = skip_idle(chip8, count);
+      continue;
+    }
+
+    uint8_t *block_len = &chip8->block_len[pc - ENTRY_POINT];
+    if (!*block_len) *block_len = translate_block(chip8, pc);
+
+    const uint8_t len = *block_len;
+    if (len > count) {
+      // Block doesn't fit in what's left of this slice, finish it one instruction at a time
+      emulate_instruction<traced, profiled>(chip8, config);
+      count--;
+      if (!traced && !profiled && chip8->idle_period) count = skip_idle(chip8, count);
+      continue;
+    }
+
+    // Threaded dispatch: only the last instruction of a block can change PC or write RAM,
+    // so the handlers run back to back. Cycles are counted up front, the block's jump sees them as emulate_instruction would
+    const decoded_inst_t *slot = &chip8->decode_cache[pc - ENTRY_POINT];
+    chip8->cycles += len;
+    count -= len;
+    for (uint8_t i = 0; i < len; i++, slot += 2) {
+      chip8->inst = slot->inst;
+      chip8->PC += 2;
+      if (profiled) {
+        chip8->profile->opcodes[slot->inst.opcode]++;
+        chip8->profile->pcs[pc + i * 2]++;
+      }
+      uint8_t V_before[16];
+      if (traced) memcpy(V_before, chip8->V, sizeof V_before);
+      slot->handler(chip8, &config);
+      if (traced) trace_instruction(chip8, pc + i * 2, V_before);
+    }
+    if (!traced && !profiled && chip8->idle_period) count = skip_idle(chip8, count);
+  }
+}
+
+// Tracing and profiling are checked once per slice, the plain loop has no instrumentation in it at all
+void run_instructions(chip8_t *chip8, const config_t config, const uint32_t count) {
+  const uint64_t start = profile_begin(chip8);
+  // Timers and keys may have changed since the last slice, a spin seen then may be over
+  chip8->idle_pc = NO_IDLE;
+  chip8->idle_period = 0;
+
+  if (chip8->profile) {
+    if (chip8->trace) {
+      execute_instructions<true, true>(chip8, config, count);
+    } else {
+      execute_instructions<false, true>(chip8, config, count);
+    }
+  } else if (chip8->trace) {
+    execute_instructions<true, false>(chip8, config, count);
+  } else {
+    execute_instructions<false, false>(chip8, config, count);
+  }
+  profile_end(chip8, PROFILE_EMULATE, start);
+}
+
+void update_timers(const sdl_t sdl, chip8_t *chip8) {
+  const uint64_t start = profile_begin(chip8);
+  chip8->frames++;
+  if (chip8->trace) trace_frame(chip8);
+  if (chip8->delay_timer > 0) chip8->delay_timer--;
+
+  // Tone plays this tick while the sound timer runs, headless mode has no audio (sdl.audio == NULL)
+  if (sdl.audio) queue_sound(sdl.audio, chip8);
+  if (chip8->sound_timer > 0) chip8->sound_timer--;
+  profile_end(chip8, PROFILE_TIMERS, start);
+}
+
+// Instructions to run this 60hz tick: inst_per_second / 60, the fraction is carried over to the next tick in *carry
+uint32_t tick_instructions(const config_t *config, uint32_t *carry) {
+  *carry += config->inst_per_second;
+  const uint32_t count = *carry / 60;
+  *carry %= 60;
+  return count;
+}
+
+// Start counting ticks from now, used at startup and on resume so paused time isn't caught up on.
+// Sound continues from where the device is
+void restart_schedule(scheduler_t *sched) {
+  sched->perf_freq = SDL_GetPerformanceFrequency();
+  sched->start_time = SDL_GetPerformanceCounter();
+  sched->tick = 0;
+  sched->input_time = SDL_GetTicks();
+  if (sched->audio) resync_audio(sched->audio);
+}
+
+// Delay until the next 60hz tick. Deadlines are absolute on the performance counter,
+// so SDL_Delay rounding and render time never accumulate into drift.
+void wait_next_tick(scheduler_t *sched, const config_t *config) {
+  if (config->unthrottled) return;
+
+  const uint64_t next_tick_time = sched->start_time + ++sched->tick * sched->perf_freq / 60;
+  const uint64_t now = SDL_GetPerformanceCounter();
+  if (now < next_tick_time) {
+    SDL_Delay((uint32_t)((next_tick_time - now) * 1000 / sched->perf_freq));
+  } else if (now - next_tick_time > sched->perf_freq / 10) {
+    // More than 100ms behind (window dragged, host stall), resync instead of fast forwarding
+    restart_schedule(sched);
+  }
+}
+
+// The tick being finished has already used up its time, the next one is due before it could even be rendered
+bool tick_overdue(const scheduler_t *sched, const config_t *config) {
+  if (config->unthrottled) return false;  // no schedule to fall behind
+  return SDL_GetPerformanceCounter() >= sched->start_time + (sched->tick + 1) * sched->perf_freq / 60;
+}
+
+// Apply every queued input now, when there is no tick to place it in (paused, rewinding)
+void apply_pending_input(chip8_t *chip8, session_t *session, input_ring_t *ring) {
+  input_event_t event;
+  while (pop_input(ring, &event)) apply_input(chip8, session, event);
+}
+
+// Emulate one tick with the input that arrived during the previous one. Each event is applied before the
+// instruction at the same relative position in this tick as its timestamp had in the previous one, so key
+// presses keep their order and spacing in emulated cycles instead of all landing on the tick boundary.
+// Stops early once an event starts a rewind, the rest of the queue waits for the next tick. Pause and quit still
+// finish the tick so every frame has the same length (movies rely on it)
+void run_tick(chip8_t *chip8, session_t *session, input_ring_t *ring, const config_t *config, scheduler_t *sched, const uint32_t count) {
+  const uint32_t now = SDL_GetTicks();
+  const uint32_t window = now - sched->input_time;
+  uint32_t done = 0;
+  input_event_t event;
+
+  while (peek_input(ring, &event) && (int32_t)(now - event.time) >= 0) {
+    const int32_t since = (int32_t)(event.time - sched->input_time);
+    const uint32_t at = (since <= 0 || !window) ? 0 : (uint32_t)since >= window ? count : (uint64_t)since * count / window;
+    if (at > done) {
+      run_instructions(chip8, *config, at - done);
+      done = at;
+    }
+    pop_input(ring, &event);
+    apply_input(chip8, session, event);
+    if (session->rewinding) break;
+  }
+  if (!session->rewinding && count > done) run_instructions(chip8, *config, count - done);
+  sched->input_time = now;
+}
+
+// FNV-1a hash of the display at its current resolution, one byte (color index) per pixel
+// so it stays comparable between runs/versions
+uint64_t display_hash(const chip8_t *chip8) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (uint32_t y = 0; y < display_rows(&chip8->display); y++) {
+    for (uint32_t x = 0; x < display_width(&chip8->display); x++) {
+      hash ^= get_pixel(&chip8->display, x, y);
+      hash *= 0x100000001B3ULL;
+    }
+  }
+  return hash;
+}
+
+// Headless sound: the same events and audio callback as an SDL device, pulled in AUDIO_BLOCK chunks as the
+// emulation produces them and written to a 16 bit mono WAV file
+typedef struct {
+  FILE *file;
+  audio_t *audio;
+  uint32_t samples;  // written so far
+} wav_t;
+
+// 44 byte RIFF header, the sizes are patched in by close_wav()
+void write_wav_header(wav_t *wav) {
+  uint8_t header[44];
+  uint8_t *p = header;
+  memcpy(p, "RIFF", 4);
+  p = put_le(p + 4, 36 + wav->samples * 2, 4);
+  memcpy(p, "WAVEfmt ", 8);
+  p = put_le(p + 8, 16, 4);                       // fmt chunk size
+  p = put_le(p, 1, 2);                            // PCM
+  p = put_le(p, 1, 2);                            // mono
+  p = put_le(p, wav->audio->sample_rate, 4);      // sample rate
+  p = put_le(p, wav->audio->sample_rate * 2, 4);  // byte rate
+  p = put_le(p, 2, 2);                            // block align
+  p = put_le(p, 16, 2);                           // bits per sample
+  memcpy(p, "data", 4);
+  put_le(p + 4, wav->samples * 2, 4);
+
+  fseek(wav->file, 0, SEEK_SET);
+  fwrite(header, 1, sizeof header, wav->file);
+}
+
+bool open_wav(wav_t *wav, const char *path, const config_t *config) {
+  wav->file = fopen(path, "wb");
+  wav->audio = (audio_t *)calloc(1, sizeof(audio_t));
+  if (!wav->file || !wav->audio) {
+    SDL_Log("Could not create WAV file %s\n", path);
+    if (wav->file) fclose(wav->file);
+    free(wav->audio);
+    return false;
+  }
+  init_audio(wav->audio, config);
+  wav->samples = 0;
+  write_wav_header(wav);
+  return true;
+}
+
+// Render every whole block the emulation has caught up to, and the partial last one when flushing
+void write_wav(wav_t *wav, const bool flush) {
+  int16_t block[AUDIO_BLOCK];
+  audio_t *audio = wav->audio;
+
+  for (;;) {
+    const uint64_t pending = audio->emu_sample - audio->play_sample;
+    if (pending == 0 || (pending < AUDIO_BLOCK && !flush)) return;
+
+    const uint32_t count = pending < AUDIO_BLOCK ? pending : AUDIO_BLOCK;
+    audio_callback(audio, (uint8_t *)block, count * sizeof block[0]);
+    fwrite(block, sizeof block[0], count, wav->file);  // host byte order, little endian on every supported target
+    wav->samples += count;
+  }
+}
+
+void close_wav(wav_t *wav) {
+  write_wav(wav, true);
+  write_wav_header(wav);
+  fclose(wav->file);
+  free(wav->audio);
+}
+
+// Replay one frame: its instructions, with the movie's events for it applied at their recorded instruction
+void replay_frame(chip8_t *chip8, const config_t config, movie_t *movie, const uint32_t count) {
+  uint32_t done = 0;
+  for (; movie->next_event < movie->event_count && movie->events[movie->next_event].frame <= movie->frame; movie->next_event++) {
+    const movie_event_t *event = &movie->events[movie->next_event];
+    const uint32_t at = event->inst < count ? event->inst : count;
+    if (at > done) {
+      run_instructions(chip8, config, at - done);
+      done = at;
+    }
+    switch (event->type) {
+      case MOVIE_KEY_DOWN: chip8->keypad[event->key] = true; break;
+      case MOVIE_KEY_UP: chip8->keypad[event->key] = false; break;
+      case MOVIE_RESET: reset_chip8(chip8); break;
+      default: break;
+    }
+  }
+  if (count > done) run_instructions(chip8, config, count - done);
+}
+
+// Write the current frame for the readers, once per tick
+void publish_shm(shm_t *shm, const chip8_t *chip8) {
+  shm_frame_t *frame = shm->frame;
+  const uint32_t seq = frame->seq.load(std::memory_order_relaxed);
+  frame->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);  // odd seq is visible before any of the frame changes
+
+  frame->frame = chip8->frames;
+  frame->cycles = chip8->cycles;
+  uint16_t keypad = 0;
+  for (uint8_t i = 0; i < 16; i++) keypad |= chip8->keypad[i] << i;
+  frame->keypad = keypad;
+  frame->state = (uint8_t)chip8->state;
+  memcpy(&frame->display, &chip8->display, sizeof frame->display);
+
+  frame->seq.store(seq + 2, std::memory_order_release);
+}
+
+// Paused: no ticks to publish from. The pause once, then whatever redraws the machine without running it
+void publish_shm_paused(shm_t *shm, const chip8_t *chip8) {
+  if (chip8->draw || shm->frame->state != PAUSED) publish_shm(shm, chip8);
+}
+
+// Create the segment and publish the machine as it is now. POSIX shared memory object /name, on Windows a named
+// file mapping backed by the page file. An existing segment is refused: its readers and keys belong to another emulator
+// (or to one that crashed, remove /dev/shm/NAME then)
+bool open_shm(shm_t *shm, const char *name, const chip8_t *chip8) {
+  memset(shm, 0, sizeof *shm);
+  const size_t size = sizeof(shm_frame_t);
+#ifdef _WIN32
+  snprintf(shm->name, sizeof shm->name, "%s", name);
+  shm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, shm->name);
+  if (shm->mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+    CloseHandle(shm->mapping);
+    SDL_Log("Shared memory %s already exists\n", name);
+    return false;
+  }
+  if (shm->mapping) shm->frame = (shm_frame_t *)MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  if (!shm->frame) {
+    if (shm->mapping) CloseHandle(shm->mapping);
+    SDL_Log("Could not create shared memory %s\n", name);
+    return false;
+  }
+#else
+  snprintf(shm->name, sizeof shm->name, "%s%s", name[0] == '/' ? "" : "/", name);
+  const int fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    SDL_Log(errno == EEXIST ? "Shared memory %s already exists\n" : "Could not create shared memory %s\n", shm->name);
+    return false;
+  }
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    shm_unlink(shm->name);
+    SDL_Log("Could not create shared memory %s\n", shm->name);
+    return false;
+  }
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);  // the mapping keeps it alive
+  if (data == MAP_FAILED) {
+    shm_unlink(shm->name);
+    SDL_Log("Could not map shared memory %s\n", shm->name);
+    return false;
+  }
+  shm->frame = (shm_frame_t *)data;
+#endif
+  // A new segment is zero filled, keys included. The header goes in last
+  shm->frame->version = SHM_VERSION;
+  shm->frame->size = size;
+  publish_shm(shm, chip8);
+  memcpy(shm->frame->magic, "C8FB", 4);
+  std::atomic_thread_fence(std::memory_order_release);
+  return true;
+}
+
+// Tell the readers the emulator is gone and remove the segment, mappings they still have stay valid
+void close_shm(shm_t *shm, const chip8_t *chip8) {
+  publish_shm(shm, chip8);
+  const uint32_t seq = shm->frame->seq.load(std::memory_order_relaxed);
+  shm->frame->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  shm->frame->state = QUIT;
+  shm->frame->seq.store(seq + 2, std::memory_order_release);
+#ifdef _WIN32
+  UnmapViewOfFile(shm->frame);
+  CloseHandle(shm->mapping);
+#else
+  munmap(shm->frame, sizeof(shm_frame_t));
+  shm_unlink(shm->name);
+#endif
+}
+
+// Keys the consumer pressed or released since the last tick, through the session so a --record movie gets them
+// (NULL = headless, straight to the keypad)
+void apply_shm_input(shm_t *shm, chip8_t *chip8, session_t *session) {
+  const uint16_t keys = (uint16_t)shm->frame->keys.load(std::memory_order_acquire);
+  const uint16_t changed = keys ^ shm->keys;
+  if (!changed) return;
+  for (uint8_t i = 0; i < 16; i++) {
+    if (!(changed & (1 << i))) continue;
+    const bool down = keys & (1 << i);
+    if (session) {
+      apply_input(chip8, session, {down ? INPUT_KEY_DOWN : INPUT_KEY_UP, i, 0});
+    } else {
+      chip8->keypad[i] = down;
+    }
+  }
+  shm->keys = keys;
+}
+
+// Headless batch run: no window, no 60hz delay, sound only into wav (NULL = none).
+// Same instructions + timer tick per frame as the windowed loop, until a limit is hit or the movie (NULL = none) ends.
+// With shm every frame is published and the consumer's keys are applied before the next one (not to a replay).
+void run_headless(chip8_t *chip8, const config_t config, wav_t *wav, movie_t *movie, shm_t *shm) {
+  sdl_t sdl = {};  // no SDL devices
+  if (wav) sdl.audio = wav->audio;
+  // Where a run from reset would be, after --load-state. A movie starts where the window started, at 0
+  uint32_t carry = movie ? 0 : (chip8->frames * config.inst_per_second) % 60;
+
+  while (chip8->state == RUNNING) {
+    if (movie && movie->frame >= movie->frames) return;
+    if (shm && !movie) apply_shm_input(shm, chip8, NULL);
+    if (config.max_instructions && chip8->cycles >= config.max_instructions) return;  // a loaded state can start past it
+    const uint32_t count = tick_instructions(&config, &carry);
+    if (config.max_instructions && config.max_instructions - chip8->cycles < count) {
+      run_instructions(chip8, config, config.max_instructions - chip8->cycles);
+      return;
+    }
+    if (movie) {
+      replay_frame(chip8, config, movie, count);
+    } else {
+      run_instructions(chip8, config, count);
+    }
+    update_timers(sdl, chip8);
+    if (movie) movie_frame(movie, chip8);
+    if (wav) write_wav(wav, false);
+    if (shm) publish_shm(shm, chip8);
+
+    if (config.max_frames && chip8->frames >= config.max_frames) return;
+  }
+}
+
+// Emulation thread: owns chip8, applies input from the ring inside its ticks and publishes every finished frame
+void emulation_thread(const sdl_t sdl, chip8_t *chip8, session_t *session, const config_t *config, frame_buffer_t *frames,
+                      input_ring_t *ring) {
+  scheduler_t sched = {};
+  sched.audio = sdl.audio;
+  restart_schedule(&sched);
+
+  while (chip8->state != QUIT) {
+    if (chip8->state == PAUSED || session->rewinding) apply_pending_input(chip8, session, ring);
+    frames->paused.store(chip8->state == PAUSED, std::memory_order_relaxed);
+
+    // Only frames that changed something (or a window that needs repainting) are handed over
+    if (chip8->state == PAUSED) {
+      if (session->shm) publish_shm_paused(session->shm, chip8);
+      if (chip8->draw) publish_frame(frames, &chip8->display, chip8->dirty);
+      chip8->dirty = 0;
+      chip8->draw = false;
+      wait_for_input(ring, IDLE_WAIT_MS);  // resume, reset, load and quit all come through the ring
+      restart_schedule(&sched);
+      continue;
+    }
+
+    const bool rewinding = session->rewinding;
+    if (rewinding) {
+      rewind_step(session, chip8);
+      if (sdl.audio) resync_audio(sdl.audio);  // no sound emulated, the next tick continues at the device
+    } else {
+      if (session->shm) apply_shm_input(session->shm, chip8, session);
+      run_tick(chip8, session, ring, config, &sched, tick_instructions(config, &sched.carry));
+    }
+    if (chip8->draw) publish_frame(frames, &chip8->display, chip8->dirty);
+    chip8->dirty = 0;
+    chip8->draw = false;
+    if (!rewinding) {
+      update_timers(sdl, chip8);
+      if (session->movie) movie_frame(session->movie, chip8);
+      record_rewind(session, chip8);
+    }
+    if (session->shm) publish_shm(session->shm, chip8);
+    wait_next_tick(&sched, config);
+  }
+  frames->done.store(true, std::memory_order_release);
+}
+
+#ifndef NO_SDL
+// SDL thread side of --emu-thread: forward input, present frames as they are published
+void run_threaded(const sdl_t *sdl, chip8_t *chip8, session_t *session, const config_t *config) {
+  static frame_buffer_t frames;  // ~12KB of atomics and buffers, kept off the stack
+  static input_ring_t ring;
+  frames.back = 0;
+  frames.latest.store(1);
+  frames.front = 2;
+  frames.done.store(false);
+
+  std::thread emu(emulation_thread, *sdl, chip8, session, config, &frames, &ring);
+
+  // Without a new frame, sleep in SDL_WaitEventTimeout: 1ms while running, longer while paused
+  uint32_t wait_ms = 0;
+  while (!frames.done.load(std::memory_order_acquire) && handle_input(sdl, &ring, wait_ms)) {
+    // Rows first: rows published after this are redrawn next time from a frame at least as new
+    const uint64_t dirty = frames.dirty.exchange(0, std::memory_order_acquire);
+    if (take_frame(&frames) || dirty) {
+      update_screen(sdl, &frames.display[frames.front], dirty, config);
+      wait_ms = 0;
+    } else {
+      wait_ms = frames.paused.load(std::memory_order_relaxed) ? IDLE_WAIT_MS : 1;
+    }
+  }
+  emu.join();
+}
+#endif
+
+// Final machine state as a single JSON line on stdout
+void print_machine_state(const chip8_t *chip8) {
+  printf("{\"rom\":\"");
+  for (const char *c = chip8->rom_name; *c; c++) {
+    if ((uint8_t)*c < 0x20) {
+      printf("\\u%04x", (uint8_t)*c);  // control characters can't appear raw in a JSON string
+      continue;
+    }
+    if (*c == '"' || *c == '\\') putchar('\\');
+    putchar(*c);
+  }
+  printf("\",\"seed\":%u,\"cycles\":%llu,\"frames\":%llu,\"pc\":%u,\"i\":%u,\"sp\":%u,\"v\":[", chip8->seed, (unsigned long long)chip8->cycles,
+         (unsigned long long)chip8->frames, chip8->PC, chip8->I, (unsigned)(chip8->stack_ptr - chip8->stack));
+  for (uint8_t i = 0; i < 16; i++) printf(i ? ",%u" : "%u", chip8->V[i]);
+  printf("],\"delay_timer\":%u,\"sound_timer\":%u,\"display_hash\":\"%016llx\"}\n", chip8->delay_timer, chip8->sound_timer,
+         (unsigned long long)display_hash(chip8));
+}
+
+// Offline trace decoder: one line per instruction, address, opcode, description and the recorded registers
+bool decode_trace_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    SDL_Log("Could not open trace %s\n", path);
+    return false;
+  }
+
+  uint8_t header[8];
+  const uint8_t *p = &header[4];
+  if (fread(header, 1, sizeof header, file) != sizeof header || memcmp(header, "C8TR", 4) != 0 || get_le(&p, 2) != TRACE_VERSION ||
+      get_le(&p, 2) != TRACE_RECORD_HEADER) {
+    SDL_Log("%s is not a version %u trace\n", path, TRACE_VERSION);
+    fclose(file);
+    return false;
+  }
+
+  trace_record_t record;
+  char desc[128];
+  uint64_t count = 0;
+  while (fread(&record, TRACE_RECORD_HEADER, 1, file) == 1) {
+    uint8_t values[16];
+    uint8_t changed = 0;
+    for (uint8_t x = 0; x < 16; x++) changed += (record.changed >> x) & 1;
+    if (fread(values, 1, changed, file) != changed) break;  // cut short
+    if (record.pc == TRACE_FRAME) {
+      printf("---- frame %u ----\n", record.opcode);  // low 16 bits
+      continue;
+    }
+    const instruction_t inst = decode_instruction(record.opcode).inst;
+    describe_instruction(inst, desc, sizeof desc);
+    printf("%10llu 0x%04X %04X %-60s I=0x%04X", (unsigned long long)count++, record.pc, record.opcode, desc, record.I);
+    for (uint8_t x = 0, v = 0; x < 16; x++) {
+      if (record.changed & (1 << x)) printf(" V%X=0x%02X", x, values[v++]);
+    }
+    putchar('\n');
+  }
+  fclose(file);
+  return true;
+}
+
+// Profiler report groups opcodes by the handler that runs them
+typedef struct {
+  opcode_handler_t handler;
+  const char *name;
+} opcode_class_t;
+
+const opcode_class_t opcode_classes[] = {
+    {op_00E0, "00E0"}, {op_00EE, "00EE"}, {op_1NNN, "1NNN"}, {op_2NNN, "2NNN"}, {op_3XNN, "3XNN"}, {op_4XNN, "4XNN"}, {op_5XY0, "5XY0"},
+    {op_6XNN, "6XNN"}, {op_7XNN, "7XNN"}, {op_8XY0, "8XY0"}, {op_8XY1, "8XY1"}, {op_8XY2, "8XY2"}, {op_8XY3, "8XY3"}, {op_8XY4, "8XY4"},
+    {op_8XY5, "8XY5"}, {op_8XY6<true>, "8XY6"}, {op_8XY7, "8XY7"}, {op_8XYE<true>, "8XYE"}, {op_9XY0, "9XY0"}, {op_ANNN, "ANNN"}, {op_BNNN<false>, "BNNN"},
+    {op_CXNN, "CXNN"}, {op_DXYN<true>, "DXYN"}, {op_EX9E, "EX9E"}, {op_EXA1, "EXA1"}, {op_FX07, "FX07"}, {op_FX0A, "FX0A"}, {op_FX15, "FX15"},
+    {op_FX18, "FX18"}, {op_FX1E, "FX1E"}, {op_FX29, "FX29"}, {op_FX33, "FX33"}, {op_FX55<true>, "FX55"}, {op_FX65<true>, "FX65"}, {op_F002, "F002"},
+    {op_FX3A, "FX3A"}, {op_00CN, "00CN"}, {op_00DN, "00DN"}, {op_00FB, "00FB"}, {op_00FC, "00FC"}, {op_00FE, "00FE"}, {op_00FF, "00FF"},
+    {op_FN01, "FN01"}, {op_FX30, "FX30"}, {op_nop, "NOP"},
+};
+#define OPCODE_CLASSES (sizeof opcode_classes / sizeof opcode_classes[0])
+
+const char *profile_section_names[PROFILE_SECTIONS] = {"emulate", "update_screen", "handle_input", "update_timers", "sleep"};
+
+uint8_t opcode_class(const uint16_t opcode) {
+  const opcode_handler_t handler = decode_instruction(opcode).handler;
+  for (uint8_t c = 0; c < OPCODE_CLASSES; c++) {
+    if (opcode_classes[c].handler == handler) return c;
+  }
+  return OPCODE_CLASSES - 1;  // NOP
+}
+
+// Executions per opcode class
+void count_opcode_classes(const profile_t *profile, uint64_t counts[OPCODE_CLASSES]) {
+  memset(counts, 0, OPCODE_CLASSES * sizeof counts[0]);
+  for (uint32_t op = 0; op < 65536; op++) {
+    if (profile->opcodes[op]) counts[opcode_class(op)] += profile->opcodes[op];
+  }
+}
+
+// Indices of the (up to) k largest non zero counts, descending. Returns how many were found
+uint32_t top_counts(const uint64_t *counts, const uint32_t n, uint16_t *top, const uint32_t k) {
+  uint32_t used = 0;
+  for (uint32_t j = 0; j < n; j++) {
+    if (!counts[j]) continue;
+    uint32_t pos = used < k ? used++ : k;
+    // Shift smaller entries down, the smallest falls off the end when the list is full
+    for (; pos > 0 && counts[top[pos - 1]] < counts[j]; pos--) {
+      if (pos < k) top[pos] = top[pos - 1];
+    }
+    if (pos < k) top[pos] = j;
+  }
+  return used;
+}
+
+// Report on exit, on stderr so headless JSON on stdout stays clean
+void print_profile(const chip8_t *chip8) {
+  const profile_t *profile = chip8->profile;
+  const double ms = 1000.0 / SDL_GetPerformanceFrequency();
+  const double total = chip8->cycles ? (double)chip8->cycles : 1.0;
+
+  fprintf(stderr, "==== PROFILE ====\n%llu instructions, %llu frames\n", (unsigned long long)chip8->cycles, (unsigned long long)chip8->frames);
+
+  uint64_t counts[OPCODE_CLASSES];
+  uint16_t order[OPCODE_CLASSES];
+  count_opcode_classes(profile, counts);
+  const uint32_t classes = top_counts(counts, OPCODE_CLASSES, order, OPCODE_CLASSES);
+  fprintf(stderr, "\nopcode        count      %%\n");
+  for (uint32_t i = 0; i < classes; i++) {
+    fprintf(stderr, "%-6s %12llu %6.2f\n", opcode_classes[order[i]].name, (unsigned long long)counts[order[i]], 100.0 * counts[order[i]] / total);
+  }
+
+  uint16_t hot[20];
+  const uint32_t addresses = top_counts(profile->pcs, 4096, hot, 20);
+  fprintf(stderr, "\nhot addresses\n");
+  for (uint32_t i = 0; i < addresses; i++) {
+    const uint16_t pc = hot[i];
+    const uint16_t opcode = (chip8->ram[pc] << 8) | chip8->ram[(pc + 1) & 0xFFF];
+    char desc[128];
+    describe_instruction(decode_instruction(opcode).inst, desc, sizeof desc);
+    fprintf(stderr, "0x%04X %12llu %6.2f  %04X %s\n", pc, (unsigned long long)profile->pcs[pc], 100.0 * profile->pcs[pc] / total, opcode, desc);
+  }
+
+  fprintf(stderr, "\nsection           calls   total ms    avg ms\n");
+  for (uint8_t s = 0; s < PROFILE_SECTIONS; s++) {
+    if (!profile->calls[s]) continue;
+    fprintf(stderr, "%-13s %9llu %10.2f %9.4f\n", profile_section_names[s], (unsigned long long)profile->calls[s], profile->ticks[s] * ms,
+            profile->ticks[s] * ms / profile->calls[s]);
+  }
+}
+
+#ifndef NO_SDL
+// Live counters in the window title, refreshed about once a second
+void update_profile_overlay(const sdl_t *sdl, chip8_t *chip8) {
+  profile_t *profile = chip8->profile;
+  const uint64_t now = SDL_GetPerformanceCounter();
+  if (profile->last_time && now - profile->last_time < SDL_GetPerformanceFrequency()) return;
+
+  const double seconds = profile->last_time ? (double)(now - profile->last_time) / SDL_GetPerformanceFrequency() : 1.0;
+  const double ms = 1000.0 / SDL_GetPerformanceFrequency();
+
+  uint64_t counts[OPCODE_CLASSES];
+  uint16_t top = OPCODE_CLASSES - 1;
+  count_opcode_classes(profile, counts);
+  top_counts(counts, OPCODE_CLASSES, &top, 1);
+
+  // Time per section over the last second, as ms per second (= per 60 frames)
+  double section_ms[PROFILE_SECTIONS];
+  for (uint8_t s = 0; s < PROFILE_SECTIONS; s++) {
+    section_ms[s] = (profile->ticks[s] - profile->last_ticks[s]) * ms / seconds;
+    profile->last_ticks[s] = profile->ticks[s];
+  }
+
+  char title[256];
+  snprintf(title, sizeof title, "Chip8 Emulator | %.0f ips | top %s %.0f%% | emulate %.1f screen %.1f input %.1f timers %.1f sleep %.0f ms/s",
+           (chip8->cycles - profile->last_cycles) / seconds, opcode_classes[top].name,
+           chip8->cycles ? 100.0 * counts[top] / chip8->cycles : 0.0, section_ms[PROFILE_EMULATE], section_ms[PROFILE_SCREEN],
+           section_ms[PROFILE_INPUT], section_ms[PROFILE_TIMERS], section_ms[PROFILE_SLEEP]);
+  SDL_SetWindowTitle(sdl->window, title);
+
+  profile->last_cycles = chip8->cycles;
+  profile->last_time = now;
+}
+#endif
+
+// --batch --lanes: LANES machines stepped in lockstep, registers in structure of arrays form so an ALU opcode
+// runs across every lane with the same opcode in one pass of fixed width loops the compiler vectorizes.
+// Lanes whose opcodes differ are stepped group by group, each group under its own lane mask; anything
+// that isn't an ALU op, a skip or a jump goes through emulate_instruction for that lane alone.
+// RAM, display, stack and timers stay in each lane's chip8_t.
+#define LANES 32              // one AVX2 register of 8 bit registers
+#define LANES_SOLO_FRAMES 15  // frames run machine by machine after the lanes diverged
+
+typedef struct {
+  uint8_t V[16][LANES];
+  uint16_t PC[LANES];
+  uint16_t I[LANES];
+  chip8_t *machine[LANES];
+  uint32_t count;  // lanes in use, the rest are stepped but never stored
+} lanes_t;
+
+void gather_lane(lanes_t *lanes, const uint32_t l) {
+  const chip8_t *chip8 = lanes->machine[l];
+  for (uint8_t r = 0; r < 16; r++) lanes->V[r][l] = chip8->V[r];
+  lanes->PC[l] = chip8->PC;
+  lanes->I[l] = chip8->I;
+}
+
+void scatter_lane(const lanes_t *lanes, const uint32_t l) {
+  chip8_t *chip8 = lanes->machine[l];
+  for (uint8_t r = 0; r < 16; r++) chip8->V[r] = lanes->V[r][l];
+  chip8->PC = lanes->PC[l];
+  chip8->I = lanes->I[l];
+}
+
+// Run the instruction for every lane in sel (0xFF = selected), false if it has no vector form
+bool step_vector(lanes_t *lanes, const decoded_inst_t decoded, const uint8_t sel[LANES]) {
+  const opcode_handler_t handler = decoded.handler;
+  const instruction_t inst = decoded.inst;
+  uint8_t *VX = lanes->V[inst.X], *VY = lanes->V[inst.Y], *VF = lanes->V[0xF];
+  uint8_t value[LANES];
+  uint8_t skip[LANES] = {0};
+
+  if (handler == op_6XNN) {
+    for (uint32_t l = 0; l < LANES; l++) VX[l] = (VX[l] & ~sel[l]) | (inst.NN & sel[l]);
+  } else if (handler == op_7XNN) {
+    for (uint32_t l = 0; l < LANES; l++) VX[l] += inst.NN & sel[l];
+  } else if (handler == op_8XY0) {
+    for (uint32_t l = 0; l < LANES; l++) VX[l] = (VX[l] & ~sel[l]) | (VY[l] & sel[l]);
+  } else if (handler == op_8XY1) {
+    for (uint32_t l = 0; l < LANES; l++) VX[l] |= VY[l] & sel[l];
+  } else if (handler == op_8XY2) {
+    for (uint32_t l = 0; l < LANES; l++) VX[l] &= VY[l] | ~sel[l];
+  } else if (handler == op_8XY3) {
+    for (uint32_t l = 0; l < LANES; l++) VX[l] ^= VY[l] & sel[l];
+  } else if (handler == op_8XY4) {
+    // Same order as the scalar handler, VF first (set to 1 on a carry, left alone otherwise), then VX, so X = F ends the same
+    for (uint32_t l = 0; l < LANES; l++) value[l] = -(uint8_t)(VX[l] + VY[l] > 255) & sel[l];
+    for (uint32_t l = 0; l < LANES; l++) VF[l] = (VF[l] & ~value[l]) | (1 & value[l]);
+    for (uint32_t l = 0; l < LANES; l++) VX[l] += VY[l] & sel[l];
+  } else if (handler == op_8XY5) {
+    for (uint32_t l = 0; l < LANES; l++) VF[l] = (VF[l] & ~sel[l]) | ((VX[l] >= VY[l]) & sel[l]);
+    for (uint32_t l = 0; l < LANES; l++) VX[l] -= VY[l] & sel[l];
+  } else if (handler == op_8XY7) {
+    for (uint32_t l = 0; l < LANES; l++) VF[l] = (VF[l] & ~sel[l]) | ((VX[l] <= VY[l]) & sel[l]);
+    for (uint32_t l = 0; l < LANES; l++) VX[l] = (VX[l] & ~sel[l]) | ((uint8_t)(VY[l] - VX[l]) & sel[l]);
+  } else if (handler == op_8XY6<true> || handler == op_8XY6<false> || handler == op_8XYE<true> || handler == op_8XYE<false>) {
+    const bool right = handler == op_8XY6<true> || handler == op_8XY6<false>;
+    const uint8_t *source = handler == op_8XY6<true> || handler == op_8XYE<true> ? VX : VY;
+    for (uint32_t l = 0; l < LANES; l++) value[l] = source[l];
+    for (uint32_t l = 0; l < LANES; l++) VX[l] = (VX[l] & ~sel[l]) | ((uint8_t)(right ? value[l] >> 1 : value[l] << 1) & sel[l]);
+    for (uint32_t l = 0; l < LANES; l++) VF[l] = (VF[l] & ~sel[l]) | ((right ? value[l] & 0x01 : value[l] >> 7) & sel[l]);
+  } else if (handler == op_3XNN) {
+    for (uint32_t l = 0; l < LANES; l++) skip[l] = (VX[l] == inst.NN) & sel[l];
+  } else if (handler == op_4XNN) {
+    for (uint32_t l = 0; l < LANES; l++) skip[l] = (VX[l] != inst.NN) & sel[l];
+  } else if (handler == op_5XY0) {
+    for (uint32_t l = 0; l < LANES; l++) skip[l] = (VX[l] == VY[l]) & sel[l];
+  } else if (handler == op_9XY0) {
+    for (uint32_t l = 0; l < LANES; l++) skip[l] = (VX[l] != VY[l]) & sel[l];
+  } else if (handler == op_ANNN) {
+    for (uint32_t l = 0; l < LANES; l++) lanes->I[l] = sel[l] ? inst.NNN : lanes->I[l];
+  } else if (handler == op_1NNN) {
+    // PC += 2 below, the jump lands on NNN
+    for (uint32_t l = 0; l < LANES; l++) lanes->PC[l] = sel[l] ? inst.NNN - 2 : lanes->PC[l];
+  } else {
+    return false;
+  }
+
+  for (uint32_t l = 0; l < LANES; l++) lanes->PC[l] += (2 + 2 * skip[l]) & sel[l];
+  return true;
+}
+
+// One instruction on every lane, returns the number of lane groups it took
+uint32_t step_lanes(lanes_t *lanes, const config_t *config) {
+  uint32_t groups = 0;
+  uint16_t opcode[LANES];
+  bool pending[LANES] = {0};
+  for (uint32_t l = 0; l < lanes->count; l++) {
+    const chip8_t *chip8 = lanes->machine[l];
+    const uint16_t pc = lanes->PC[l];
+    opcode[l] = (chip8->ram[pc & 0xFFF] << 8) | chip8->ram[(pc + 1) & 0xFFF];
+    pending[l] = true;
+  }
+
+  for (uint32_t leader = 0; leader < lanes->count; leader++) {
+    if (!pending[leader]) continue;
+
+    // Every lane still pending with the leader's opcode and quirk profile runs with it
+    chip8_t *chip8 = lanes->machine[leader];
+    groups++;
+    uint8_t sel[LANES] = {0};
+    uint32_t size = 0;
+    for (uint32_t l = leader; l < lanes->count; l++) {
+      if (pending[l] && opcode[l] == opcode[leader] && lanes->machine[l]->decode == chip8->decode) {
+        sel[l] = 0xFF;
+        pending[l] = false;
+        size++;
       }
-      break;
-    }
-    case 0x09: {
-      // 0x9XY0: Skips the next instruction if VX doesn't equal NN (usually the
-      // next instruction is a jump to skip a code block)
-      printf(
-          "Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if "
-          "true.\n",
-          chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-      break;
-    }
-    case 0x0B: {
-      // 0xBNNN: Jump to the address NNN + V0
-      printf("Set PC to V0 (0x%02X) + NNN (0x%04X); Result: PC = %04X\n", chip8->V[0], chip8->inst.NNN, chip8->V[0] + chip8->inst.NNN);
-      break;
-    }
-    case 0x0A: {
-      // 0xANNN: SET index register I to NNN
-      printf("SET index register I to NNN (0x%04X)\n", chip8->inst.NNN);
-      break;
     }
-    case 0x0C: {
-      // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
-      printf("Set V%X = rand() %% 256 & NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
-      break;
+
+    // A lane on its own is cheaper through the scalar handler than a pass over every lane
+    chip8->PC = lanes->PC[leader];
+    if (size > 1 && step_vector(lanes, fetch_instruction(chip8, config->engine), sel)) {
+      for (uint32_t l = leader; l < lanes->count; l++) lanes->machine[l]->cycles += sel[l] & 1;
+      continue;
     }
-    case 0x0D: {
-      // 0xDXYN: Draw N-height sprite at coords X,Y; Read from mem location I;
-      // Screen pixels are XOR'd with sprite bits,
-      // VF carry flag is set any screen pixles are set off; This is useful for
-      // collision detection or other reasons
-      printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) from memory location I (0x%04X). Set VF = 1 if any pixels are turned off. \n",
-             chip8->inst.N, chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->I);
-      break;
+
+    // Scalar fallback, same handler as a lone machine
+    for (uint32_t l = leader; l < lanes->count; l++) {
+      if (!sel[l]) continue;
+      scatter_lane(lanes, l);
+      emulate_instruction<false, false>(lanes->machine[l], *config);
+      gather_lane(lanes, l);
     }
-    case 0x0E: {
-      if (chip8->inst.NN == 0x9E) {
-        printf("Skip next instruction if key in V%X (0x%02X) is pressed; Keypad value: %d\n", chip8->inst.X, chip8->V[chip8->inst.X],
-               chip8->keypad[chip8->V[chip8->inst.X]]);
-      } else if (chip8->inst.NN == 0xA1) {
-        printf("Skip next instruction if key in V%X (0x%02X) is not pressed; Keypad value: %d\n", chip8->inst.X, chip8->V[chip8->inst.X],
-               chip8->keypad[chip8->V[chip8->inst.X]]);
+  }
+  return groups;
+}
+
+// run_headless for count (<= LANES) machines that start at the same cycle and frame, as batch instances do.
+// A machine that stops (stack fault) leaves the lanes after its frame, as run_headless would return
+void run_lanes(chip8_t *machines, const uint32_t count, const config_t config) {
+  lanes_t lanes = {};
+  lanes.count = count;
+  for (uint32_t l = 0; l < count; l++) {
+    lanes.machine[l] = &machines[l];
+    gather_lane(&lanes, l);
+  }
+
+  const sdl_t sdl = {};
+  uint32_t carry = (machines[0].frames * config.inst_per_second) % 60;
+  uint32_t solo_frames = 0;  // Lanes went their own ways: run them one machine at a time for a while, then try again
+  while (lanes.count) {
+    const chip8_t *first = lanes.machine[0];  // every lane is at the same cycle and frame
+    if (config.max_instructions && first->cycles >= config.max_instructions) break;
+    uint32_t steps = tick_instructions(&config, &carry);
+    const bool last = config.max_instructions && config.max_instructions - first->cycles < steps;
+    if (last) steps = config.max_instructions - first->cycles;
+
+    if (solo_frames) {
+      solo_frames--;
+      for (uint32_t l = 0; l < lanes.count; l++) {
+        scatter_lane(&lanes, l);
+        run_instructions(lanes.machine[l], config, steps);
+        gather_lane(&lanes, l);
       }
-      break;
+    } else {
+      uint64_t groups = 0;
+      for (uint32_t i = 0; i < steps; i++) groups += step_lanes(&lanes, &config);
+      if (groups * 4 > (uint64_t)steps * lanes.count) solo_frames = LANES_SOLO_FRAMES;  // more than a group per 4 lanes
     }
-    case 0x0F: {
-      switch (chip8->inst.NN) {
-        case 0x0A:
-          // 0xFX0A: VX = get_key() Чекај додека не е стиснато копче, и внеси го
-          // во VX
-          printf("Await until a key is pressed; Store key in V%X\n", chip8->inst.X);
-          break;
-        case 0x1E:
-          // 0xFX1E: I += VX; Add VX to register I. For non-Amiga CHIP8, does
-          // not affect VF.
-          printf("I (0x%04X) += V%X (0x%02X); Result (I): 0x%04X\n", chip8->I, chip8->inst.X, chip8->V[chip8->inst.X], chip8->I + chip8->V[chip8->inst.X]);
-          break;
-        case 0x07:
-          // 0xFX07: VX = delay timer
-          printf("Set V%X = delay timer value (0x%02X)\n", chip8->inst.X, chip8->delay_timer);
-          break;
-        case 0x15:
-          // 0xFX15: delay timer = VX
-          printf("Set delay timer value (0x%02X) = V%X\n", chip8->delay_timer, chip8->inst.X);
-          break;
-        case 0x18:
-          // 0xFX18: sound timer = VX
-          printf("Set sound timer value (0x%02X) = V%X\n", chip8->sound_timer, chip8->inst.X);
-          break;
-        case 0x29:
-          // 0xFX29 Set register I to sprite location in memory for character in VX (0x0-0xF)
-          printf("Set I to sprite location in memory for character V%X (0x%02X). Result * 5 = (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
-                 chip8->V[chip8->inst.X] * 5);
-          break;
-        case 0x33:
-          // 0xFX33 Store BCD representation of VX at memory offset from I
-          // I = hundred's place, I+1 = ten's place, I+2 one's place
-          printf("Store BCD representation of V%X (0x%02X) at memory from I (0x%04X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-          break;
-        case 0x55:
-          // 0xFX55 Register dump V0-VX inclusive to memory offset from I
-          // SCHIP does not increment I, Chip-8 does
-          printf("Register dump V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-          break;
-        case 0x65:
-          // 0xFX65 Register load V0-VX inclusive from memory offset from I
-          // SCHIP does not increment I, Chip-8 does
-          printf("Register load V0-V%X (0x%02X) inclusive from memory from I (0x%04X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-          break;
+    if (last) break;
+
+    for (uint32_t l = 0; l < lanes.count; l++) update_timers(sdl, lanes.machine[l]);
+    if (config.max_frames && first->frames >= config.max_frames) break;
+
+    // Stopped machines are done, the last lane takes their place
+    for (uint32_t l = 0; l < lanes.count;) {
+      if (lanes.machine[l]->state == RUNNING) {
+        l++;
+        continue;
       }
-      break;
-      default: printf("Unimplemented\n"); break;
-    } break;
+      scatter_lane(&lanes, l);
+      scatter_lane(&lanes, --lanes.count);
+      lanes.machine[l] = lanes.machine[lanes.count];
+      gather_lane(&lanes, l);
+    }
   }
+  for (uint32_t l = 0; l < lanes.count; l++) scatter_lane(&lanes, l);
 }
-#endif
-
-void emulate_instruction(chip8_t *chip8, const config_t config) {
-  chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];  // следен operation code од рам
-  chip8->PC += 2;  // инкрементирање на Program Counter за 2 бајти затоа што 1
-                   // опкод е 16 бита
 
-  // Current instruction format
-  chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
-  chip8->inst.NN = chip8->inst.opcode & 0x0FF;
-  chip8->inst.N = chip8->inst.opcode & 0x0F;
-  chip8->inst.X = (chip8->inst.opcode >> 8) & 0x0F;
-  chip8->inst.Y = (chip8->inst.opcode >> 4) & 0x0F;
+// Batch work: each worker starts on its own slice of the instance array and steals from the others'
+// slices when it runs out. Owner and thieves both claim instances with fetch_add, so no locks.
+typedef struct {
+  alignas(64) std::atomic<uint32_t> next;  // own cache line, workers hammer each other's counters
+  uint32_t end;
+} work_range_t;
 
-#ifdef DEBUG
-  print_debug_info(chip8, config);
-#endif
+// A work item is one machine, or with --lanes a group of up to LANES machines
+void batch_worker(chip8_t *machines, const uint32_t count, work_range_t *ranges, const uint32_t threads, const uint32_t self,
+                  const config_t *config) {
+  for (uint32_t r = 0; r < threads; r++) {
+    work_range_t *range = &ranges[(self + r) % threads];  // own slice first, then steal
 
-  // Emulate opcode
-  switch ((chip8->inst.opcode >> 12) & 0x0F) {
-    case 0x00: {
-      if (chip8->inst.NN == 0xE0) {
-        // 0x00E0: Clear the screen
-        memset(&chip8->display[0], false, sizeof chip8->display);
-      } else if (chip8->inst.NN == 0xEE) {
-        // 0x00EE: Return from subroutine
-        // Set program counter to last address on subroutine stack so that
-        // next opcode will be gotten from that address
-        chip8->PC = *--chip8->stack_ptr;
+    for (uint32_t i = range->next.fetch_add(1); i < range->end; i = range->next.fetch_add(1)) {
+      if (config->lanes) {
+        run_lanes(&machines[i * LANES], count - i * LANES < LANES ? count - i * LANES : LANES, *config);
       } else {
-        // Unimplemented/invalid opcode, may be 0xNNN for calling machine code
-        // routine RCA1802
+        run_headless(&machines[i], *config, NULL, NULL, NULL);
       }
-      break;
-    }
-    case 0x01: {
-      // 0x1NNN: Jump to address NNN
-      chip8->PC = chip8->inst.NNN;  // Set PC so that next opcode is from NNN.
-      break;
-    }
-    case 0x02: {
-      // 0x2NNN: Call subroutine at NNN
-      *chip8->stack_ptr++ = chip8->PC;  // Store current address to return to on subroutine stack
-      chip8->PC = chip8->inst.NNN;      // set PC to subroutine address so that
-                                        // the next opcode is gotten from there.
-      break;
     }
-    case 0x03: {
-      // 0x3XNN: Skips the next instruction if VX equals NN (usually the next
-      // instruction is a jump to skip a code block)
-      if (chip8->V[chip8->inst.X] == chip8->inst.NN) chip8->PC += 2;
-      break;
+  }
+}
+
+// Library entry point: run count headless machines to the configured limit on a pool of threads
+void run_batch(chip8_t *machines, const uint32_t count, const config_t *config) {
+  const uint32_t items = config->lanes ? (count + LANES - 1) / LANES : count;
+  uint32_t threads = config->threads ? config->threads : std::thread::hardware_concurrency();
+  if (threads == 0) threads = 1;
+  if (threads > items) threads = items;
+
+  work_range_t *ranges = new work_range_t[threads];
+  for (uint32_t t = 0; t < threads; t++) {
+    ranges[t].next = (uint64_t)items * t / threads;
+    ranges[t].end = (uint64_t)items * (t + 1) / threads;
+  }
+
+  std::thread *workers = new std::thread[threads - 1];
+  for (uint32_t t = 1; t < threads; t++) workers[t - 1] = std::thread(batch_worker, machines, count, ranges, threads, t, config);
+  batch_worker(machines, count, ranges, threads, 0, config);  // this thread is worker 0
+  for (uint32_t t = 1; t < threads; t++) workers[t - 1].join();
+
+  delete[] workers;
+  delete[] ranges;
+}
+
+// --batch: every ROM x --instances, seeds config.seed, config.seed + 1, ... in instance order
+bool batch_main(const config_t *config, rom_library_t *library, const rom_db_t *db) {
+  const uint32_t count = config->rom_count * config->instances;
+  chip8_t *machines = (chip8_t *)calloc(count, sizeof(chip8_t));
+  if (!machines) {
+    SDL_Log("Could not allocate %u machines\n", count);
+    return false;
+  }
+
+  // Each ROM is mapped once, its instances copy from the mapping and get its quirks
+  const rom_t *rom = NULL;
+  for (uint32_t i = 0; i < count; i++) {
+    if (i % config->instances == 0) rom = find_rom(library, db, config->roms[i / config->instances]);
+    if (!rom || !init_chip8(&machines[i], rom)) {
+      free(machines);
+      return false;
     }
-    case 0x04: {
-      // 0x4XNN: Skips the next instruction if VX doesn't equal NN (usually
-      // the next instruction is a jump to skip a code block)
-      if (chip8->V[chip8->inst.X] != chip8->inst.NN) chip8->PC += 2;
-      break;
+    if (config->load_state_file && !load_state_file(&machines[i], config->load_state_file)) {
+      free(machines);
+      return false;
     }
-    case 0x05: {
-      // 0x5XY0: Skips the next instruction if VX equals VY (usually the next
-      // instruction is a jump to skip a code block)
-      if (chip8->inst.N != 0) break;
+    seed_chip8(&machines[i], config->seed + i);  // the state's rng would make every instance identical
+  }
 
-      if (chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) chip8->PC += 2;
-      break;
+  const uint64_t start = SDL_GetPerformanceCounter();
+  run_batch(machines, count, config);
+  const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+  uint64_t cycles = 0, frames = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    print_machine_state(&machines[i]);
+    cycles += machines[i].cycles;
+    frames += machines[i].frames;
+  }
+  fprintf(stderr, "%u instances, %llu instructions, %llu frames in %.3fs (%.0f frames/s)\n", count, (unsigned long long)cycles,
+          (unsigned long long)frames, seconds, frames / seconds);
+
+  free(machines);
+  return true;
+}
+
+// Benchmark corpus: generated programs that each hammer one part of the core. Every engine runs each one for the same
+// number of frames with the same seed, so the numbers compare between engines and between versions
+typedef struct {
+  const char *name;
+  const uint8_t *rom;
+  size_t size;
+} bench_rom_t;
+
+// 8XYN/7XNN arithmetic in a tight loop
+const uint8_t bench_alu[] = {
+    0x60, 0x01, 0x61, 0x03, 0x80, 0x14, 0x81, 0x05, 0x82, 0x03, 0x83, 0x26,
+    0x84, 0x0E, 0x75, 0x01, 0x85, 0x12, 0x86, 0x71, 0x88, 0x17, 0x12, 0x04,
+};
+
+// Three DXYN draws per loop at moving coordinates, sprite data at 0x220
+const uint8_t bench_sprites[] = {
+    0x60, 0x00, 0x61, 0x00, 0xA2, 0x20, 0xD0, 0x1F, 0x70, 0x03, 0x71, 0x05, 0xD0, 0x1F, 0x70, 0x0B, 0x71, 0x02,
+    0xD0, 0x18, 0x12, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF0, 0x99, 0x3C, 0x7E,
+    0xFF, 0x81, 0xA5, 0xC3, 0x18, 0x24, 0x42, 0x81, 0xFF, 0x00, 0xAA,
+};
+
+// Nested 2NNN/00EE three calls deep
+const uint8_t bench_calls[] = {
+    0x22, 0x06, 0x12, 0x00, 0x00, 0x00, 0x22, 0x0C, 0x70, 0x01, 0x00, 0xEE,
+    0x22, 0x12, 0x71, 0x01, 0x00, 0xEE, 0x72, 0x01, 0x00, 0xEE,
+};
+
+// FX55/FX65 of all 16 registers
+const uint8_t bench_memory[] = {
+    0xA3, 0x00, 0xFF, 0x55, 0xA3, 0x00, 0xFF, 0x65, 0x70, 0x01, 0x71, 0x02, 0x12, 0x00,
+};
+
+const bench_rom_t bench_roms[] = {
+    {"alu", bench_alu, sizeof bench_alu},
+    {"sprites", bench_sprites, sizeof bench_sprites},
+    {"calls", bench_calls, sizeof bench_calls},
+    {"memory", bench_memory, sizeof bench_memory},
+};
+
+#define BENCH_IPS 6000000  // 100000 instructions per frame
+#define BENCH_FRAMES 120   // default length, --max-frames overrides it
+
+// One JSON line per ROM x engine on stdout
+bool bench_main(const config_t *config) {
+  const emu_engine_t engines[] = {INTERPRETER, PREDECODE, THREADED};
+  const char *engine_names[] = {"interp", "predecode", "threaded"};
+
+  chip8_t *chip8 = (chip8_t *)malloc(sizeof(chip8_t));
+  if (!chip8) {
+    SDL_Log("Could not allocate the machine\n");
+    return false;
+  }
+
+  for (uint32_t r = 0; r < sizeof bench_roms / sizeof bench_roms[0]; r++) {
+    for (uint32_t e = 0; e < sizeof engines / sizeof engines[0]; e++) {
+      config_t run = *config;
+      run.engine = engines[e];
+      run.inst_per_second = BENCH_IPS;
+      run.max_instructions = 0;
+      run.max_frames = config->max_frames ? config->max_frames : BENCH_FRAMES;
+
+      if (!load_chip8(chip8, (char *)bench_roms[r].name, bench_roms[r].rom, bench_roms[r].size)) {
+        free(chip8);
+        return false;
+      }
+      seed_chip8(chip8, 1);
+
+#ifdef COUNT_ALLOCATIONS
+      const uint64_t allocs = allocations.load(std::memory_order_relaxed);
+#endif
+      const uint64_t start = SDL_GetPerformanceCounter();
+      run_headless(chip8, run, NULL, NULL, NULL);
+      const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+      // Not counted outside the bench build: null rather than a 0 that means nothing
+      char allocated[24] = "null";
+#ifdef COUNT_ALLOCATIONS
+      snprintf(allocated, sizeof allocated, "%llu", (unsigned long long)(allocations.load(std::memory_order_relaxed) - allocs));
+#endif
+      printf("{\"bench\":\"%s\",\"engine\":\"%s\",\"instructions\":%llu,\"frames\":%llu,\"seconds\":%.6f,\"inst_per_sec\":%.0f,"
+             "\"ns_per_frame\":%.1f,\"allocations\":%s,\"display_hash\":\"%016llx\"}\n",
+             bench_roms[r].name, engine_names[e], (unsigned long long)chip8->cycles, (unsigned long long)chip8->frames, seconds,
+             chip8->cycles / seconds, seconds * 1e9 / chip8->frames, allocated, (unsigned long long)display_hash(chip8));
+      fflush(stdout);
     }
-    case 0x06: {
-      // 0x6XNN: Set register VX to NN
-      chip8->V[chip8->inst.X] = chip8->inst.NN;
-      break;
+  }
+
+  free(chip8);
+  return true;
+}
+
+#ifndef NO_SDL
+// Render a frame only if it changed something. With --frame-skip, while the loop is catching up on a late
+// schedule up to frame_skip changed frames in a row are left for the next one, their dirty rows add up until then
+void present_frame(const sdl_t *sdl, chip8_t *chip8, const config_t *config, scheduler_t *sched) {
+  if (!chip8->draw) return;
+  if (sched->skipped < config->frame_skip && tick_overdue(sched, config)) {
+    sched->skipped++;
+    return;
+  }
+  sched->skipped = 0;
+
+  const uint64_t start = profile_begin(chip8);
+  update_screen(sdl, &chip8->display, chip8->dirty, config);
+  chip8->dirty = 0;
+  chip8->draw = false;
+  profile_end(chip8, PROFILE_SCREEN, start);
+}
+
+// Single threaded windowed loop: input, one 60hz tick of emulation, render, timers, wait
+void run_main_loop(const sdl_t *sdl, chip8_t *chip8, session_t *session, const config_t *config) {
+  scheduler_t sched = {};
+  sched.audio = sdl->audio;
+  restart_schedule(&sched);
+
+  // Main Emulator loop
+  static input_ring_t ring;  // input waits here for its place in the next tick
+
+  while (chip8->state != QUIT) {
+    // Handle input, paused: sleep until there is some
+    uint64_t start = profile_begin(chip8);
+    handle_input(sdl, &ring, chip8->state == PAUSED ? IDLE_WAIT_MS : 0);
+    if (chip8->state == PAUSED || session->rewinding) apply_pending_input(chip8, session, &ring);
+    profile_end(chip8, PROFILE_INPUT, start);
+
+    if (chip8->state == PAUSED) {
+      if (session->shm) publish_shm_paused(session->shm, chip8);
+      present_frame(sdl, chip8, config, &sched);  // window exposed while paused
+      restart_schedule(&sched);
+      continue;
     }
-    case 0x07: {
-      // 0x7XNN: Set register VX += NN
-      chip8->V[chip8->inst.X] += chip8->inst.NN;
-      break;
+
+    if (session->rewinding) {
+      // Step back one recorded frame per tick while the rewind key is held
+      rewind_step(session, chip8);
+      if (sdl->audio) resync_audio(sdl->audio);  // no sound emulated, the next tick continues at the device
+      present_frame(sdl, chip8, config, &sched);
+    } else {
+      // Emulate
+      if (session->shm) apply_shm_input(session->shm, chip8, session);
+      run_tick(chip8, session, &ring, config, &sched, tick_instructions(config, &sched.carry));
+
+      // update Window
+      present_frame(sdl, chip8, config, &sched);
+      // update delay and sound
+      update_timers(*sdl, chip8);
+      if (session->movie) movie_frame(session->movie, chip8);
+
+      record_rewind(session, chip8);
     }
-    case 0x08: {
-      switch (chip8->inst.N) {
-        case 0:
-          // 0x8XY0: Set register VX = VY
-          chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-          break;
-        case 1:
-          // 0x8XY1: Set register VX |= VY
-          chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-          break;
-        case 2:
-          // 0x8XY2: Set register VX &= VY
-          chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-          break;
-        case 3:
-          // 0x8XY3: Set register VX ^= VY
-          chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-          break;
-        case 4:
-          // 0x8XY4: Set register VX += VY, VF is set to 1 when there's an
-          // overflow If the addition results in a value greater than 255
-          // (since CHIP-8 uses 8-bit registers), an overflow occurs.
-          if ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255) chip8->V[0xF] = 1;
-          chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-          break;
-        case 5:
-          // 0x8XY5: Set register VX -= VY, if there is not a borrow ( result is positive ) set VF to 1
-          chip8->V[0xF] = (chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]);
-          chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
-          break;
-        case 6:
-          // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-          chip8->V[0xF] = chip8->V[chip8->inst.X] & 0x01;
-          chip8->V[chip8->inst.X] >>= 1;
-          break;
-        case 7:  // TODO
-          // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow ( result is positive )
-          chip8->V[0xF] = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]);
-          chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-          break;
-        case 0xE:  // TODO
-          // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-          chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-          chip8->V[chip8->inst.X] <<= 1;
-          break;
-        default: break;
+    if (session->shm) publish_shm(session->shm, chip8);
+    if (chip8->profile) update_profile_overlay(sdl, chip8);
+
+    // Delay for 60hz
+    start = profile_begin(chip8);
+    wait_next_tick(&sched, config);
+    profile_end(chip8, PROFILE_SLEEP, start);
+  }
+}
+#endif
+
+#ifdef FUZZ
+// Fuzz target (make fuzz), LLVMFuzzerTestOneInput driven by the coverage-guided loop in main below. Input: byte 0 = engine (bits 0-1) and keypad event count (bits 2-7), then per event
+// the frame it happens in and the key (bit 4 = pressed), the rest is the ROM image. Every input runs on the chosen
+// engine and on the interpreter, which must end in the same state. Engine 3 is --lanes: FUZZ_LANES instances of
+// the ROM with their own seeds (so CXNN makes them diverge) stepped by run_lanes without keypad events, each
+// checked against the interpreter lane by lane. Besides the compiler's own coverage, emulated control flow edges
+// (previous PC -> PC) are counted so ROMs that reach new code are kept.
+#define FUZZ_FRAMES 60
+#define FUZZ_IPS 700
+#define FUZZ_EDGES 4096  // power of 2
+#define FUZZ_LANES 8
+
+uint8_t fuzz_edges[FUZZ_EDGES];  // hits per edge of the current input
+
+// Everything a ROM can change, pointers as offsets
+bool same_machine(const chip8_t *a, const chip8_t *b) {
+  return memcmp(a->ram, b->ram, sizeof a->ram) == 0 && memcmp(&a->display, &b->display, sizeof a->display) == 0 &&
+         memcmp(a->V, b->V, sizeof a->V) == 0 && memcmp(a->stack, b->stack, sizeof a->stack) == 0 &&
+         a->stack_ptr - a->stack == b->stack_ptr - b->stack && a->PC == b->PC && a->I == b->I && a->delay_timer == b->delay_timer &&
+         a->sound_timer == b->sound_timer && a->plane_mask == b->plane_mask && a->rng == b->rng && a->pitch == b->pitch &&
+         a->pattern_loaded == b->pattern_loaded && memcmp(a->audio_pattern, b->audio_pattern, sizeof a->audio_pattern) == 0 &&
+         a->state == b->state;
+}
+
+void fuzz_run(chip8_t *chip8, const config_t *config, const uint8_t *events, const uint8_t count, const bool edges) {
+  const sdl_t sdl = {};
+  uint32_t carry = 0;
+  uint8_t e = 0;
+  for (uint32_t frame = 0; frame < FUZZ_FRAMES && chip8->state == RUNNING; frame++) {
+    for (; e < count && events[2 * e] <= frame; e++) chip8->keypad[events[2 * e + 1] & 0x0F] = events[2 * e + 1] & 0x10;
+
+    const uint32_t instructions = tick_instructions(config, &carry);
+    if (!edges || config->engine == THREADED) {
+      run_instructions(chip8, *config, instructions);  // blocks: one edge per frame
+      if (edges) fuzz_edges[chip8->PC & (FUZZ_EDGES - 1)]++;
+    } else {
+      for (uint32_t i = 0; i < instructions; i++) {
+        const uint16_t pc = chip8->PC;
+        emulate_instruction<false, false>(chip8, *config);
+        fuzz_edges[(chip8->PC ^ (pc >> 1)) & (FUZZ_EDGES - 1)]++;
       }
-      break;
-    }
-    case 0x09: {
-      // 0x9XY0: If VX != VY, skip next instruction
-      if (chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y]) chip8->PC += 2;
-      break;
     }
-    case 0x0A: {
-      // 0xANNN: SET index register I to NNN
-      chip8->I = chip8->inst.NNN;
-      break;
+    update_timers(sdl, chip8);
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  // Pristine machine, copied per input instead of rebuilding RAM, font and decoder every time
+  static chip8_t pristine, machine, reference;
+  static bool ready = false;
+  if (!ready) {
+    load_chip8(&pristine, (char *)"fuzz", NULL, 0);
+    seed_chip8(&pristine, 1);
+    ready = true;
+  }
+  if (size < 1) return 0;
+
+  config_t config = {};
+  config.inst_per_second = FUZZ_IPS;
+  config.engine = (emu_engine_t)((data[0] & 0x03) % 3);
+  const uint8_t count = (size - 1) / 2 < (size_t)(data[0] >> 2) ? (size - 1) / 2 : data[0] >> 2;
+  const uint8_t *events = data + 1, *rom = events + 2 * count;
+  size_t rom_size = size - 1 - 2 * count;
+  if (rom_size > sizeof pristine.ram - ENTRY_POINT) rom_size = sizeof pristine.ram - ENTRY_POINT;
+
+  if ((data[0] & 0x03) == 3) {
+    static chip8_t lanes[FUZZ_LANES];
+    for (uint32_t l = 0; l < FUZZ_LANES; l++) {
+      memcpy(&lanes[l], &pristine, sizeof lanes[l]);
+      lanes[l].stack_ptr = lanes[l].stack;
+      memcpy(&lanes[l].ram[ENTRY_POINT], rom, rom_size);
+      seed_chip8(&lanes[l], l + 1);
     }
-    case 0x0B: {
-      // 0xBNNN: Jump to the address NNN + V0
-      chip8->PC = chip8->V[0] + chip8->inst.NNN;
-      break;
+    config.engine = PREDECODE;  // the scalar fallback
+    config.max_frames = FUZZ_FRAMES;
+    run_lanes(lanes, FUZZ_LANES, config);
+
+    config.engine = INTERPRETER;
+    for (uint32_t l = 0; l < FUZZ_LANES; l++) {
+      memcpy(&reference, &pristine, sizeof reference);
+      reference.stack_ptr = reference.stack;
+      memcpy(&reference.ram[ENTRY_POINT], rom, rom_size);
+      seed_chip8(&reference, l + 1);
+      fuzz_run(&reference, &config, NULL, 0, false);
+      if (!same_machine(&lanes[l], &reference) || lanes[l].cycles != reference.cycles || lanes[l].frames != reference.frames) {
+        SDL_Log("Lane %u and the interpreter disagree\n", l);
+        abort();
+      }
     }
-    case 0x0C: {
-      // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
-      chip8->V[chip8->inst.X] = rand() % 256 & chip8->inst.NN;
-      break;
+    return 0;
+  }
+
+  memcpy(&machine, &pristine, sizeof machine);
+  machine.stack_ptr = machine.stack;
+  memcpy(&machine.ram[ENTRY_POINT], rom, rom_size);
+  fuzz_run(&machine, &config, events, count, true);
+
+  if (config.engine != INTERPRETER) {
+    memcpy(&reference, &pristine, sizeof reference);
+    reference.stack_ptr = reference.stack;
+    memcpy(&reference.ram[ENTRY_POINT], rom, rom_size);
+    config.engine = INTERPRETER;
+    fuzz_run(&reference, &config, events, count, false);
+    if (!same_machine(&machine, &reference)) {
+      SDL_Log("Engine %u and the interpreter disagree\n", data[0] & 0x03);
+      abort();
     }
-    case 0x0D: {
-      // 0xDXYN: Draw N-height sprite at coords X,Y; Read from mem location I;
-      // Screen pixels are XOR'd with sprite bits,
-      // VF carry flag is set any screen pixles are set off; This is useful
-      // for collision detection or other reasons
-      uint8_t X_coord = chip8->V[chip8->inst.X] % config.window_width;
-      uint8_t Y_coord = chip8->V[chip8->inst.Y] % config.window_height;
-      const uint8_t orig_X = X_coord;  // Оригинална вредност на X
-
-      chip8->V[0xF] = 0;  // Иницијализација на carry flag
-
-      // Loop over all N rows of the sprite
-      for (uint8_t i = 0; i < chip8->inst.N; i++) {
-        // Get next byte/row of sprite data
-        const uint8_t sprite_data = chip8->ram[chip8->I + i];
-        X_coord = orig_X;
-
-        for (int8_t j = 7; j >= 0; j--) {
-          // Доколку sprite pixel/bit е вклучен и display pixel е вклучен, пушти carry flag
-          bool *pixel = &chip8->display[Y_coord * config.window_width + X_coord];
-          const bool sprite_bit = (sprite_data & (1 << j));
-          if (sprite_bit && *pixel) {
-            chip8->V[0xF] = 1;
-          }
-          // XOR display pixel со sprite pixel/bit за да го вклучиме или исклучиме
-          *pixel ^= sprite_bit;
-
-          // Престани да црташ ако стигнеш до десниот крај на екранот
-          if (++X_coord >= config.window_width) break;
+  }
+  return 0;
+}
+
+// Coverage-guided driver: the corpus starts with the files on the command line (or one empty input). Every run
+// mutates a corpus entry (bit flips, random bytes, growth, truncation, a slice of another entry) and keeps the
+// result if it hit an emulated edge no earlier input did. Memory errors are ASan/UBSan's, disagreements abort.
+// chip8_fuzz [-runs=N] [-seed=N] [corpus files...]
+#define FUZZ_RUNS 100000
+#define FUZZ_CORPUS 4096
+#define FUZZ_MAX_LEN (1 + 2 * 63 + 4096 - ENTRY_POINT)  // header, every keypad event, a full ROM
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+} fuzz_input_t;
+
+uint32_t fuzz_random(uint32_t *rng) {
+  uint32_t x = *rng;  // xorshift32
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *rng = x;
+}
+
+size_t fuzz_mutate(uint8_t *buf, size_t size, const fuzz_input_t *corpus, const uint32_t count, uint32_t *rng) {
+  for (uint32_t m = 1 + fuzz_random(rng) % 4; m; m--) {
+    const fuzz_input_t *other = &corpus[fuzz_random(rng) % count];
+    switch (fuzz_random(rng) % 5) {
+      case 0:
+        if (size) buf[fuzz_random(rng) % size] ^= 1 << (fuzz_random(rng) % 8);
+        break;
+      case 1:
+        if (size) buf[fuzz_random(rng) % size] = fuzz_random(rng);
+        break;
+      case 2:
+        for (uint32_t n = 1 + fuzz_random(rng) % 16; n && size < FUZZ_MAX_LEN; n--) buf[size++] = fuzz_random(rng);
+        break;
+      case 3:
+        if (size > 1) size -= fuzz_random(rng) % (size / 2 + 1);
+        break;
+      case 4:
+        if (other->size && size) {
+          const size_t from = fuzz_random(rng) % other->size, to = fuzz_random(rng) % size;
+          size_t len = 1 + fuzz_random(rng) % other->size;
+          if (len > other->size - from) len = other->size - from;
+          if (len > FUZZ_MAX_LEN - to) len = FUZZ_MAX_LEN - to;
+          memcpy(&buf[to], &other->data[from], len);
+          if (to + len > size) size = to + len;
         }
-        // Престани да црташ ако стигнеш до долниот крај на екранот
-        if (++Y_coord >= config.window_height) break;
-      }
-      break;
+        break;
     }
-    case 0x0E: {
-      if (chip8->inst.NN == 0x9E) {
-        if (chip8->keypad[chip8->V[chip8->inst.X]]) chip8->PC += 2;
-      } else if (chip8->inst.NN == 0xA1) {
-        if (!chip8->keypad[chip8->V[chip8->inst.X]]) chip8->PC += 2;
+  }
+  return size;
+}
+
+bool add_fuzz_input(fuzz_input_t *corpus, uint32_t *count, const uint8_t *data, const size_t size) {
+  if (*count == FUZZ_CORPUS) return false;
+  corpus[*count].data = (uint8_t *)malloc(size ? size : 1);
+  if (!corpus[*count].data) return false;
+  if (size) memcpy(corpus[*count].data, data, size);
+  corpus[(*count)++].size = size;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  static fuzz_input_t corpus[FUZZ_CORPUS];
+  static uint8_t buf[FUZZ_MAX_LEN];
+  static bool seen[FUZZ_EDGES];
+  uint64_t runs = FUZZ_RUNS;
+  uint32_t rng = 1, count = 0, edges = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "-runs=", 6) == 0) {
+      runs = strtoull(argv[i] + 6, NULL, 10);
+    } else if (strncmp(argv[i], "-seed=", 6) == 0) {
+      rng = strtoul(argv[i] + 6, NULL, 10);
+      if (!rng) rng = 1;  // xorshift state must never be 0
+    } else {
+      FILE *file = fopen(argv[i], "rb");
+      if (!file) {
+        SDL_Log("Could not open %s\n", argv[i]);
+        return EXIT_FAILURE;
       }
-      break;
+      const size_t size = fread(buf, 1, sizeof buf, file);
+      fclose(file);
+      add_fuzz_input(corpus, &count, buf, size);
     }
-    case 0x0F: {
-      switch (chip8->inst.NN) {
-        case 0x0A: {
-          // 0xFX0A: VX = get_key() Чекај додека не е стиснато копче, и внеси го во VX
-          bool key_pressed = false;
-          for (uint8_t i = 0; i < sizeof chip8->keypad; i++) {
-            if (chip8->keypad[i] == true) {
-              chip8->V[chip8->inst.X] = chip8->keypad[i];
-              key_pressed = true;
-            };
-          }
-          if (!key_pressed) chip8->PC -= 2;
-          break;
-        }
-        case 0x1E: {
-          // 0xFX1E: I += VX; Add VX to register I. For non-Amiga CHIP8, does not affect VF.
-          chip8->I += chip8->V[chip8->inst.X];
-          break;
-        }
-        case 0x07: {
-          // 0xFX07: VX = delay timer
-          chip8->V[chip8->inst.X] = chip8->delay_timer;
-          break;
-        }
-        case 0x15: {
-          // 0xFX15: delay timer = VX
-          chip8->delay_timer = chip8->V[chip8->inst.X];
-          break;
-        }
-        case 0x18: {
-          // 0xFX18: sound timer = VX
-          chip8->sound_timer = chip8->V[chip8->inst.X];
-          break;
-        }
-        case 0x29: {
-          // 0xFX29 Set register I to sprite location in memory for character in VX (0x0-0xF)
-          chip8->I = chip8->V[chip8->inst.X] * 5;
-          break;
-        }
-        case 0x33: {
-          // 0xFX33 Store BCD representation of VX at memory offset from I
-          // I = hundred's place, I+1 = ten's place, I+2 one's place
-          uint8_t bcd = chip8->V[chip8->inst.X];
-          chip8->ram[chip8->I + 2] = bcd % 10;
-          bcd /= 10;
-          chip8->ram[chip8->I + 1] = bcd % 10;
-          bcd /= 10;
-          chip8->ram[chip8->I] = bcd;
-          break;
-        }
-        case 0x55: {
-          // 0xFX55 Register dump V0-VX inclusive to memory offset from I
-          // SCHIP does not increment I, Chip-8 does
-          for (uint8_t i = 0; i <= chip8->inst.X; i++) {
-            chip8->ram[chip8->I + i] = chip8->V[i];
-          }
-          break;
-        }
-        case 0x65: {
-          // 0xFX65 Set register I to sprite location in memory for character in VX (0x0-0xF)
-          for (uint8_t i = 0; i <= chip8->inst.X; i++) {
-            chip8->V[i] = chip8->ram[chip8->I + i];
-          }
-          break;
-        }
-        default: break;
+  }
+  if (!count) add_fuzz_input(corpus, &count, buf, 0);
+  const uint32_t initial = count;
+
+  for (uint64_t run = 0; run < runs; run++) {
+    const fuzz_input_t *base = &corpus[run < initial ? run : fuzz_random(&rng) % count];
+    size_t size = base->size;
+    memcpy(buf, base->data, size);
+    if (run >= initial) size = fuzz_mutate(buf, size, corpus, count, &rng);
+
+    memset(fuzz_edges, 0, sizeof fuzz_edges);
+    LLVMFuzzerTestOneInput(buf, size);
+
+    bool fresh = false;
+    for (uint32_t e = 0; e < FUZZ_EDGES; e++) {
+      if (fuzz_edges[e] && !seen[e]) {
+        seen[e] = true;
+        fresh = true;
+        edges++;
       }
-      break;
     }
-    default: break;
+    if (fresh && run >= initial) add_fuzz_input(corpus, &count, buf, size);
   }
+  printf("%llu runs, %u edges, %u inputs in the corpus\n", (unsigned long long)runs, edges, count);
+  for (uint32_t i = 0; i < count; i++) free(corpus[i].data);
+  return EXIT_SUCCESS;
 }
+#elif defined(AUDIO_CHECK)
+// Sound device timing check (make check). The device is simulated in output samples: it asks for a block once
+// playback reaches the end of the last one, and it starts 10 blocks before the first tick and plays on through a pause,
+// so emulated audio time lags playback the way it does with a window. Every tone switch must land on its stamp
+#define CHECK_SAMPLES 65536
 
-void update_timers(const sdl_t sdl, chip8_t *chip8) {
-  if (chip8->delay_timer > 0) chip8->delay_timer--;
-  if (chip8->sound_timer > 0) {
-    chip8->sound_timer--;
-    SDL_PauseAudioDevice(sdl.dev, 0);  // Play sound
-  } else {
-    SDL_PauseAudioDevice(sdl.dev, 1);  // Pause sound
-  }
+// Device callbacks up to sample now, straight into out
+void play_until(audio_t *audio, int16_t *out, const uint64_t now) {
+  while (audio->play_sample <= now) audio_callback(audio, (uint8_t *)&out[audio->play_sample], AUDIO_BLOCK * sizeof out[0]);
 }
 
+int main(void) {
+  static int16_t out[CHECK_SAMPLES + AUDIO_BLOCK];
+  static sound_event_t posted[16];
+  uint32_t count = 0;
+  config_t config = {};
+  config.audio_sample_rate = 44100;
+  config.square_wave_freq = 440;
+  config.volume = 3000;
+
+  audio_t *audio = (audio_t *)calloc(1, sizeof(audio_t));
+  chip8_t *chip8 = (chip8_t *)calloc(1, sizeof(chip8_t));
+  if (!audio || !chip8) return EXIT_FAILURE;
+  chip8->pitch = 64;  // as after init_chip8, only the sound timer changes
+  init_audio(audio, &config);
+  audio->latency = AUDIO_BLOCK;  // as init_sdl sets it
+  scheduler_t sched = {};
+  sched.audio = audio;
+
+  uint64_t now = 10 * AUDIO_BLOCK;  // window and ROM loading
+  play_until(audio, out, now);
+  restart_schedule(&sched);
+  for (uint32_t tick = 0; tick < 40; tick++) {
+    if (tick == 20) {  // paused for 30 blocks
+      now += 30 * AUDIO_BLOCK;
+      play_until(audio, out, now);
+      restart_schedule(&sched);
+    }
+    chip8->sound_timer = (tick >= 5 && tick < 8) || (tick >= 25 && tick < 27) || tick == 33;
+
+    const uint32_t head = audio->head.load(std::memory_order_relaxed);
+    queue_sound(audio, chip8);
+    if (audio->head.load(std::memory_order_relaxed) != head) {
+      posted[count] = audio->events[head % SOUND_RING_SIZE];
+      if (posted[count].sample < audio->play_sample) {
+        SDL_Log("Tick %u: the tone switch is stamped %llu, already played up to %llu\n", tick, (unsigned long long)posted[count].sample,
+                (unsigned long long)audio->play_sample);
+        return EXIT_FAILURE;
+      }
+      count++;
+    }
+    now += config.audio_sample_rate / 60;
+    play_until(audio, out, now);
+  }
+
+  // Silence and the tone (never 0, the square wave is +-volume) switch exactly at each stamp
+  for (uint32_t i = 0; i < count; i++) {
+    const uint64_t at = posted[i].sample;
+    if ((out[at - 1] != 0) == posted[i].on || (out[at] != 0) != posted[i].on) {
+      SDL_Log("The tone switch stamped %llu doesn't land on that sample\n", (unsigned long long)at);
+      return EXIT_FAILURE;
+    }
+  }
+  printf("%u tone switches on the exact sample\n", count);
+  free(chip8);
+  free(audio);
+  return count == 6 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#else
 int main(int argc, char **argv) {
   // Default Usage message for args
   if (argc < 2) {
-    fprintf(stderr, "Usage: %s <rom_name>\n", argv[0]);
+    fprintf(stderr, "Usage: %s <rom_name> [--headless --max-inst N --max-frames N]\n", argv[0]);
+    fprintf(stderr, "       %s <rom_name>... --batch [--instances N --seed N --threads N --lanes] --max-inst N | --max-frames N\n", argv[0]);
+    fprintf(stderr, "       %s <rom_name> --record FILE | --replay FILE\n", argv[0]);
+    fprintf(stderr, "       %s <rom_name> --shm NAME [--headless --max-inst N --max-frames N]\n", argv[0]);
+    fprintf(stderr, "       %s <rom_name|hash> --library DIR [--rom-db FILE]\n", argv[0]);
+    fprintf(stderr, "       %s --decode-trace FILE\n", argv[0]);
+    fprintf(stderr, "       %s --bench [--max-frames N]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
   // Init emulator configurations/options
-  config_t config = {0};
+  config_t config = {};
   if (!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
 
-  // Иницијализација на SDL2
-  sdl_t sdl;
-  if (!init_sdl(&sdl, &config)) exit(EXIT_FAILURE);
+  if (config.decode_trace_file) exit(decode_trace_file(config.decode_trace_file) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  if (config.bench) exit(bench_main(&config) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  // ROMs are mapped once, from the library directory or the command line, with their settings from the database
+  static rom_library_t library;
+  static rom_db_t db;
+  if (!open_library(&library, config.library_dir, config.rom_count)) exit(EXIT_FAILURE);
+  if (config.rom_db_file && !load_rom_db(&db, config.rom_db_file)) exit(EXIT_FAILURE);
+
+  if (config.batch) exit(batch_main(&config, &library, &db) ? EXIT_SUCCESS : EXIT_FAILURE);
 
   // Иницијализација на CHIP8
   chip8_t chip8;
-  char *rom_name = argv[1];
-  if (!init_chip8(&chip8, rom_name)) exit(EXIT_FAILURE);
+  const rom_t *rom = find_rom(&library, &db, config.roms[0]);
+  if (!rom || !init_chip8(&chip8, rom)) exit(EXIT_FAILURE);
+  seed_chip8(&chip8, config.seed);
+  apply_rom_settings(&config, rom->settings);
 
-  // Init Screen Clear to background color
-  clear_screen(sdl, config, &chip8);
+  if (config.load_state_file && !load_state_file(&chip8, config.load_state_file)) exit(EXIT_FAILURE);
+
+  // A replay starts from the movie's state at the recorded speed
+  movie_t movie = {};
+  if (config.replay_file) {
+    if (!load_movie(&movie, config.replay_file, &chip8)) exit(EXIT_FAILURE);
+    config.inst_per_second = movie.ips;
+    config.engine = movie.engine;
+  }
 
-  srand(time(NULL));
+  // Instrumentation, both are kept across reset
+  if (config.profile) {
+    chip8.profile = (profile_t *)calloc(1, sizeof(profile_t));
+    if (!chip8.profile) exit(EXIT_FAILURE);
+  }
 
-  // Main Emulator loop
-  while (chip8.state != QUIT) {
-    // Handle input
-    handle_input(&chip8);
+  // Tracing starts with --trace, F10 toggles it in a window
+  tracer_t tracer{};
+  tracer.path = config.trace_file ? config.trace_file : "chip8.trace";
+  if (config.trace_file) {
+    if (!start_trace(&tracer)) exit(EXIT_FAILURE);
+    chip8.trace = &tracer;
+  }
 
-    if (chip8.state == PAUSED) continue;
+  // Frames out to other processes, keypad in
+  static shm_t shm;
+  if (config.shm_name && !open_shm(&shm, config.shm_name, &chip8)) exit(EXIT_FAILURE);
 
-    const uint64_t start_frame_time = SDL_GetPerformanceCounter();
-    // Emulate
-    for (uint32_t i = 0; i < 16; i++) emulate_instruction(&chip8, config);
+  if (config.headless) {
+    wav_t wav;
+    if (config.wav_file && !open_wav(&wav, config.wav_file, &config)) exit(EXIT_FAILURE);
+    run_headless(&chip8, config, config.wav_file ? &wav : NULL, config.replay_file ? &movie : NULL,
+                 config.shm_name ? &shm : NULL);
+    if (config.shm_name) close_shm(&shm, &chip8);
+    free(movie.events);
+    if (config.wav_file) close_wav(&wav);
+    if (chip8.trace) stop_trace(chip8.trace);
+    if (chip8.profile) print_profile(&chip8);
+    print_machine_state(&chip8);
+    if (config.save_state_file && !save_state_file(&chip8, config.save_state_file)) exit(EXIT_FAILURE);
+    close_library(&library);
+    free_rom_db(&db);
+    exit(EXIT_SUCCESS);
+  }
 
-    const uint64_t end_frame_time = SDL_GetPerformanceCounter();
+#ifndef NO_SDL
+  // Иницијализација на SDL2
+  sdl_t sdl = {};
+  static keymap_t keymap;
+  if (!load_keymap(&keymap, config.keymap_file)) exit(EXIT_FAILURE);
+  sdl.keymap = &keymap;
+  if (!init_sdl(&sdl, &config)) exit(EXIT_FAILURE);
 
-    const double time_elapsed = (double)((end_frame_time - start_frame_time) * 1000) / SDL_GetPerformanceFrequency();
-    // Delay for 60hz
-    SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
+  // Init Screen Clear to background color
+  clear_screen(sdl, config);
+
+  // Save slots and rewind, owned by whichever thread applies input
+  session_t *session = (session_t *)calloc(1, sizeof(session_t));
+  if (!session || !init_rewind(session, config.rewind_seconds)) exit(EXIT_FAILURE);
+  session->tracer = &tracer;
+  if (config.shm_name) session->shm = &shm;
+  if (config.record_file) {
+    if (!start_recording(&movie, config.record_file, &chip8, &config)) exit(EXIT_FAILURE);
+    session->movie = &movie;
+  }
 
-    // update Window
-    update_screen(sdl, chip8, config);
-    // update delay and sound
-    update_timers(sdl, &chip8);
+  if (config.emu_thread) {
+    run_threaded(&sdl, &chip8, session, &config);
+  } else {
+    run_main_loop(&sdl, &chip8, session, &config);
   }
 
+  if (session->movie) stop_recording(session->movie);
+  if (session->shm) close_shm(session->shm, &chip8);
+  if (config.save_state_file) save_state_file(&chip8, config.save_state_file);
+  if (chip8.trace) stop_trace(chip8.trace);
+  if (chip8.profile) print_profile(&chip8);
+
   // Final Cleanup
+  free_rewind(session);
+  free(session);
+  free(chip8.profile);
+  close_library(&library);
+  free_rom_db(&db);
   final_cleanup(sdl);
+#endif
 
   exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
+#endif
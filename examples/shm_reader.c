@@ -0,0 +1,125 @@
+// Example --shm consumer (Linux/POSIX, C11): follows the frames of a running emulator and holds keys on its keypad.
+// make shm_reader, then: ./chip8 rom.ch8 --shm chip8 &  ./shm_reader chip8 [keys]
+// keys is a hex mask (bit k = hold key k) written once at the start. One line per new frame, the screen when it quits.
+//
+// Layout of the segment (version 1, little endian, 4152 bytes), chip8.cpp shm_frame_t checks the same offsets:
+//    0 char[4]  magic "C8FB", written last, after everything else is initialized
+//    4 u32      version
+//    8 u32      size of the segment
+//   12 u32      seq, odd while the emulator is writing a frame
+//   16 u64      frames run
+//   24 u64      instructions run
+//   32 u16      machine keypad, bit k = key k down
+//   34 u8       state: 0 quit (the emulator is gone), 1 running, 2 paused
+//   40 u64[4][64][2] display bit planes, row r of plane p at [p][r], bit 63 of word 0 = left pixel
+// 4136 u8       hires, 128x64 instead of 64x32 (rows 0-31 and word 0 only)
+// 4144 u32      keys, written by the consumer only: bit k = hold key k
+//
+// Seqlock: load seq (acquire), skip it while odd, copy the fields, fence (acquire), load seq again. The copy is
+// consistent if both loads saw the same value, otherwise try again. seq doesn't move on its own while paused,
+// the frame counter tells whether the machine got any further.
+#define _DEFAULT_SOURCE  // usleep
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t size;
+  _Atomic uint32_t seq;
+  uint64_t frame;
+  uint64_t cycles;
+  uint16_t keypad;
+  uint8_t state;
+  struct {
+    uint64_t planes[4][64][2];
+    bool hires;
+  } display;  // a struct of its own in the emulator, keys comes after its padding
+  _Atomic uint32_t keys;
+} shm_frame_t;
+
+_Static_assert(offsetof(shm_frame_t, display.hires) == 4136 && offsetof(shm_frame_t, keys) == 4144 && sizeof(shm_frame_t) == 4152,
+               "layout differs from the emulator's");
+
+// What a reader keeps from one frame
+typedef struct {
+  uint64_t frame;
+  uint64_t cycles;
+  uint16_t keypad;
+  uint8_t state;
+  uint64_t plane0[64][2];
+  bool hires;
+} snapshot_t;
+
+void read_frame(shm_frame_t *shm, snapshot_t *out) {
+  for (;;) {
+    const uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+    if (seq & 1) continue;  // mid write
+    out->frame = shm->frame;
+    out->cycles = shm->cycles;
+    out->keypad = shm->keypad;
+    out->state = shm->state;
+    memcpy(out->plane0, shm->display.planes[0], sizeof out->plane0);
+    out->hires = shm->display.hires;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&shm->seq, memory_order_relaxed) == seq) return;
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s NAME [keys]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  char name[256];
+  snprintf(name, sizeof name, "%s%s", argv[1][0] == '/' ? "" : "/", argv[1]);
+
+  const int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    fprintf(stderr, "No shared memory %s, is the emulator running with --shm?\n", name);
+    return EXIT_FAILURE;
+  }
+  shm_frame_t *shm = mmap(NULL, sizeof *shm, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s\n", name);
+    return EXIT_FAILURE;
+  }
+
+  while (memcmp(shm->magic, "C8FB", 4) != 0) usleep(1000);  // just created, the emulator is still filling it in
+  atomic_thread_fence(memory_order_acquire);
+  if (shm->version != 1 || shm->size != sizeof *shm) {
+    fprintf(stderr, "%s has version %u, %u bytes: not a layout this reader knows\n", name, shm->version, shm->size);
+    return EXIT_FAILURE;
+  }
+  if (argc > 2) atomic_store_explicit(&shm->keys, strtoul(argv[2], NULL, 16) & 0xFFFF, memory_order_release);
+
+  snapshot_t frame;
+  uint64_t last = UINT64_MAX;
+  do {
+    read_frame(shm, &frame);
+    if (frame.frame != last) {
+      printf("frame %llu, %llu instructions, keypad 0x%04X, state %u\n", (unsigned long long)frame.frame,
+             (unsigned long long)frame.cycles, frame.keypad, frame.state);
+      last = frame.frame;
+    }
+    usleep(1000);
+  } while (frame.state != 0);
+
+  // The last frame, plane 0
+  const int width = frame.hires ? 128 : 64, rows = frame.hires ? 64 : 32;
+  for (int y = 0; y < rows; y++) {
+    for (int x = 0; x < width; x++) putchar((frame.plane0[y][x / 64] >> (63 - x % 64)) & 1 ? '#' : '.');
+    putchar('\n');
+  }
+  munmap(shm, sizeof *shm);
+  return EXIT_SUCCESS;
+}